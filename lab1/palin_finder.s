@@ -1,122 +1,403 @@
-.global _start
-
-.section .text
-
-_start:
-	ldr r12, =input
-	bl get_length // write length to r2
-	mov r11, r3 // store length
-	bl to_lower // convert to lowercase
-	b check_palindrome // check palindrome in r12 of length r11
-
-// char at r3 is <= Z, this checks if it is >= A, if so it makes it lowercase
-possible_uppercase:
-	cmp r3, #65 // if char is after A
-	addge r3, #32 // 32 is diff between A and a
-	bx lr
-
-// converts string to lowercase
-to_lower:
- // r0 counter
- 	mov r0, #0
-	push {lr} // needed because nested call
-	to_lower_loop:
-		ldrb r3, [r12, r0]
-		cmp r3, #90 // if char is becore Z
-		blle possible_uppercase // update character if it really is uppercase
-		strb r3, [r12, r0] // write character that might have bee updated
-		add r0, #1 // increment counter
-		cmp r0, r11 // have we reached length
-		popeq {pc} // if so jump back
-		b to_lower_loop // if not, move on
-
-get_length:
-	mov r3, #0 // using r3 to return length
-	loop:
-		add r3, #1 //  increment length
-		ldrb r2, [r12, r3] // use r2 to store character
-		cmp r2, #0   // is it null terminated
-		bne loop      // we have not found last character
-	bx lr // back to start
-
-check_palindrome:
-	mov r1, r11 // count from last
-	sub r1, #1 // dont care about terminating character
-	mov r0, #0 // count from first
-	paliloop:
-		ldrb r2, [r12, r0] // beginning char
-		ldrb r3, [r12, r1] // end char
-		cmp r2, r3 // first and last char
-		bne palindrome_not_found // not eq
-		bl iterate_counters // iterate counters
-		cmp r0, r1 // have the counters crossed?
-		bge palindrome_found // if they have crossed we have checked entire word, know it's palindrome
-		b paliloop // need to check more of word
-
-// iterates register skipping over any spaces encountered
-iterate_counters:
-	// we have to iterate at least once
-	add r0, #1
-	sub r1, #1
-	first_counter_loop:
-		ldrb r2, [r12, r0]
-		cmp r2, #32 // is char space?
-		addeq r0, #1 // skip space
-		beq first_counter_loop 	// might be more spaces
-	second_counter_loop:
-		ldrb r2, [r12, r1]
-		cmp r2, #32 // is char space
-		subeq r1, #1 // is so skip it
-		beq second_counter_loop // might be more spaces after this one
-	bx lr
-
-
-palindrome_found:
-	// Switch on only the 5 rightmost LEDs
-	// Write 'Palindrome detected' to UART
-	ldr r0, =0xff200000 // led address
-	mov r1, #0x1f // 0b0000011111 led code
-    str r1, [r0]  // write led code
-	ldr r0, =found_output // set string param
-	b write_res // write string
-
-
-palindrome_not_found:
-	ldr r0, =0xff200000 //led code
-	mov r1, #0xfe0 // 0b1111100000
-    str r1, [r0] // write led code
-	ldr r0, =not_found_output
-	b write_res // write string
-
-write_res:
-	mov r1, #0 // used for word counter
-	ldr r2, =0xff201000 // jtag uart address
-	write_loop:
-		ldrb r3, [r0, r1] // load char
-		str r3, [r2] // write char
-		cmp r3, #0   // have we reach termination
-		beq exit    // if so exit
-		add r1, #1  // if not increment counter
-		b write_loop // repeat
-
-
-exit:
-	// Branch here for exit
-	b exit
-
-
-.section .data
-.align
-	// This is the input you are supposed to check for a palindrome
-	// You can modify the string during development, however you
-	// are not allowed to change the label 'input'!
-	input: .asciz "level"
-	found_output: .asciz "Palindrome detected"
-	not_found_output: .asciz "Not a palindrome"
-	// input: .asciz "8448"
-    // input: .asciz "KayAk"
-    // input: .asciz "step on no pets"
-    // input: .asciz "Never odd or even"
-
-
-.end
+.global _start
+
+.equ max_length, 32768 // longest input (without spaces) for mode 1
+
+.section .text
+
+_start:
+	ldr r12, =input
+	ldr r0, =mode
+	ldr r0, [r0]
+	cmp r0, #1
+	beq longest_palindrome
+	bl compact // lowercase and remove spaces, writes length to r11
+	b check_palindrome // check palindrome in r12 of length r11
+
+// Lowercases the input and removes its spaces in place, one word (4 chars)
+// per ldr. Writes the new length to r11.
+// A word without terminator or spaces is case folded with bit tricks and
+// appended whole; the others are handled byte by byte. Bytes waiting to be
+// written are packed in r2 from the low end, so every str stays word aligned.
+// Writing never overtakes reading, the input itself must be word aligned.
+// The words read may reach past the terminator, the ones written never do.
+compact:
+	push {r4-r10, lr}
+	ldr r4, =0x01010101 // ones in every byte
+	ldr r5, =0x7f7f7f7f // all but the high bit of every byte
+	ldr r6, =0x3f3f3f3f // byte + 0x3f has the high bit set if byte >= 'A'
+	ldr r7, =0x25252525 // byte + 0x25 has the high bit set if byte > 'Z'
+	mov r0, r12 // read pointer
+	mov r1, r12 // write pointer
+	mov r2, #0 // bytes waiting to be written
+	mov r3, #0 // number of bits waiting in r2
+	compact_loop:
+		ldr r8, [r0], #4 // next 4 chars
+		// case fold: high bit of every byte in A..Z, shifted down to 0x20
+		and r9, r8, r5
+		add r10, r9, r6
+		add r9, r9, r7
+		bic r10, r10, r9
+		orr r9, r8, r5
+		bic r10, r10, r9 // not for bytes >= 0x80
+		orr r8, r8, r10, lsr #2
+		// does the word contain the terminator?
+		sub r9, r8, r4
+		bic r9, r9, r8
+		bics r9, r9, r5
+		bne compact_bytes
+		// does the word contain a space?
+		eor r10, r8, r4, lsl #5 // spaces become zero bytes
+		sub r9, r10, r4
+		bic r9, r9, r10
+		bics r9, r9, r5
+		bne compact_bytes
+		// append all 4 chars behind the waiting ones
+		orr r9, r2, r8, lsl r3
+		str r9, [r1], #4
+		rsb r10, r3, #32
+		mov r2, r8, lsr r10 // shifting by 32 gives 0
+		b compact_loop
+	compact_bytes:
+		mov r10, #4 // chars left in word
+		compact_bytes_loop:
+			ands r9, r8, #0xff // next char
+			beq compact_done // terminator
+			cmp r9, #32 // is char space?
+			beq compact_next // skip it
+			orr r2, r2, r9, lsl r3
+			add r3, r3, #8
+			cmp r3, #32 // full word waiting?
+			streq r2, [r1], #4
+			moveq r2, #0
+			moveq r3, #0
+			compact_next:
+			mov r8, r8, lsr #8
+			subs r10, r10, #1
+			bne compact_bytes_loop
+		b compact_loop
+	compact_done:
+		sub r11, r1, r12
+		add r11, r11, r3, lsr #3 // length
+		compact_flush: // write the chars still waiting, not past the terminator
+			subs r3, r3, #8
+			poplt {r4-r10, pc}
+			strb r2, [r1], #1
+			mov r2, r2, lsr #8
+			b compact_flush
+
+// Compares the first 4 chars with the reversed last 4 chars, moving inwards
+// a word at a time. The back word starts at any alignment, it is put together
+// from two aligned words, the upper of which is the lower of the previous
+// round. The at most 7 chars in the middle are compared byte by byte.
+check_palindrome:
+	mov r0, #0 // front offset
+	sub r1, r11, #4 // back offset, chars r1..r1+3 reversed must match r0..r0+3
+	add r2, r0, #4
+	cmp r2, r1 // do front and back word overlap?
+	bgt check_bytes
+	and r3, r1, #3
+	mov r3, r3, lsl #3 // bits the back word is above an aligned word
+	rsb r4, r3, #32
+	bic r5, r1, #3
+	add r5, r12, r5 // aligned word holding the start of the back word
+	ldr r7, [r5, #4] // upper word
+	check_words_loop:
+		ldr r6, [r5], #-4 // lower word
+		mov r8, r6, lsr r3
+		orr r8, r8, r7, lsl r4 // shifting by 32 gives 0
+		mov r7, r6 // upper word of the next round
+		rev r8, r8 // reversed back word
+		ldr r2, [r12, r0] // front word
+		cmp r2, r8
+		bne palindrome_not_found
+		add r0, #4
+		sub r1, #4
+		add r2, r0, #4
+		cmp r2, r1 // do front and back word overlap?
+		ble check_words_loop
+	check_bytes:
+		add r1, #3 // last char not yet compared
+	check_bytes_loop:
+		cmp r0, r1 // have the counters crossed?
+		bge palindrome_found // if they have crossed we have checked entire word, know it's palindrome
+		ldrb r2, [r12, r0] // beginning char
+		ldrb r3, [r12, r1] // end char
+		cmp r2, r3 // first and last char
+		bne palindrome_not_found // not eq
+		add r0, #1
+		sub r1, #1
+		b check_bytes_loop
+
+
+// Mode 1: finds the longest palindromic substring with Manacher's algorithm,
+// ignoring case and spaces like check_palindrome. Writes
+// 'Longest palindrome <first>-<last>: <chars>' to UART, where first and last
+// are offsets of its ends in the input, and shows its length on the LEDs.
+longest_palindrome:
+	bl map_positions
+	cmp r11, #max_length
+	bgt input_too_long
+	bl compact // same chars as mapped
+	cmp r11, #0
+	beq palindrome_not_found // nothing but spaces
+	bl manacher
+	mov r4, r0 // first char
+	mov r5, r1 // length
+	ldr r0, =0xff200000 // led address
+	ldr r1, =0x3ff
+	mov r2, r5
+	cmp r2, r1
+	movgt r2, r1 // saturate at all 10 LEDs
+	str r2, [r0]
+	ldr r1, =result_output
+	ldr r0, =longest_output
+	longest_prefix_loop:
+		ldrb r2, [r0], #1
+		cmp r2, #0
+		beq longest_prefix_done
+		strb r2, [r1], #1
+		b longest_prefix_loop
+	longest_prefix_done:
+	ldr r6, =pos_map
+	ldr r0, [r6, r4, lsl #2] // offset of the first char
+	bl write_decimal
+	mov r2, #'-'
+	strb r2, [r1], #1
+	add r7, r4, r5
+	sub r7, #1
+	ldr r0, [r6, r7, lsl #2] // offset of the last char
+	bl write_decimal
+	mov r2, #':'
+	strb r2, [r1], #1
+	mov r2, #' '
+	strb r2, [r1], #1
+	add r4, r12
+	longest_chars_loop:
+		ldrb r2, [r4], #1
+		strb r2, [r1], #1
+		subs r5, #1
+		bne longest_chars_loop
+	strb r5, [r1] // terminate
+	ldr r0, =result_output
+	b write_res
+
+input_too_long:
+	ldr r0, =0xff200000 // led address
+	mov r1, #0xfe0 // 0b1111100000
+	str r1, [r0]
+	ldr r0, =too_long_output
+	b write_res
+
+// Stores the offset in the input of every char compact keeps in pos_map,
+// writes their count to r11
+map_positions:
+	ldr r1, =pos_map
+	mov r0, #0 // offset in input
+	mov r11, #0
+	map_loop:
+		ldrb r2, [r12, r0]
+		cmp r2, #0 // terminator?
+		bxeq lr
+		cmp r2, #32 // space?
+		beq map_next
+		cmp r11, #max_length // only count once full
+		strlt r0, [r1, r11, lsl #2]
+		add r11, #1
+		map_next:
+		add r0, #1
+		b map_loop
+
+// Manacher's algorithm over the r11 chars at r12. radius_odd[i] is the
+// number of chars the palindrome centered on char i reaches to each side
+// including i itself, radius_even[i] the number the one centered between
+// chars i - 1 and i reaches to each side. Both reuse the radius of the mirror
+// position inside the rightmost palindrome found so far, so every char is
+// compared a constant number of times on average.
+// Returns the first char of the longest palindrome, the leftmost one of those,
+// in r0 and its length in r1.
+manacher:
+	push {r4-r10}
+	mov r7, #0 // longest length
+	mov r8, #0 // its first char
+	ldr r4, =radius_odd
+	mov r0, #0 // center i
+	mov r1, #0 // first char of the rightmost palindrome
+	mvn r2, #0 // its last char, -1 for none
+	odd_loop:
+		cmp r0, r11
+		bge odd_done
+		mov r3, #1 // radius
+		cmp r0, r2
+		bgt odd_expand // outside, start from scratch
+		add r5, r1, r2
+		sub r5, r0 // mirror of i
+		ldr r3, [r4, r5, lsl #2]
+		sub r5, r2, r0
+		add r5, #1 // chars left to the end of the rightmost palindrome
+		cmp r3, r5
+		movgt r3, r5
+		odd_expand:
+			sub r5, r0, r3
+			cmp r5, #0
+			blt odd_store
+			add r6, r0, r3
+			cmp r6, r11
+			bge odd_store
+			ldrb r9, [r12, r5]
+			ldrb r10, [r12, r6]
+			cmp r9, r10
+			addeq r3, #1
+			beq odd_expand
+		odd_store:
+		str r3, [r4, r0, lsl #2]
+		add r5, r0, r3
+		sub r5, #1 // last char
+		cmp r5, r2
+		subgt r1, r0, r3
+		addgt r1, #1
+		movgt r2, r5
+		mov r5, r3, lsl #1
+		sub r5, #1 // length
+		cmp r5, r7
+		movgt r7, r5
+		subgt r8, r0, r3
+		addgt r8, #1
+		add r0, #1
+		b odd_loop
+	odd_done:
+	ldr r4, =radius_even
+	mov r0, #0
+	mov r1, #0
+	mvn r2, #0
+	even_loop:
+		cmp r0, r11
+		bge even_done
+		mov r3, #0
+		cmp r0, r2
+		bgt even_expand
+		add r5, r1, r2
+		sub r5, r0
+		add r5, #1 // mirror of i
+		ldr r3, [r4, r5, lsl #2]
+		sub r5, r2, r0
+		add r5, #1
+		cmp r3, r5
+		movgt r3, r5
+		even_expand:
+			sub r5, r0, r3
+			subs r5, #1
+			blt even_store
+			add r6, r0, r3
+			cmp r6, r11
+			bge even_store
+			ldrb r9, [r12, r5]
+			ldrb r10, [r12, r6]
+			cmp r9, r10
+			addeq r3, #1
+			beq even_expand
+		even_store:
+		str r3, [r4, r0, lsl #2]
+		add r5, r0, r3
+		sub r5, #1
+		cmp r5, r2
+		subgt r1, r0, r3
+		movgt r2, r5
+		mov r5, r3, lsl #1 // length
+		cmp r5, r7
+		movgt r7, r5
+		subgt r8, r0, r3
+		add r0, #1
+		b even_loop
+	even_done:
+	mov r0, r8
+	mov r1, r7
+	pop {r4-r10}
+	bx lr
+
+// Writes r0 in decimal to r1, advances r1. Divides by 10 as a multiply by
+// 0xcccccccd and a shift, the digits are put together backwards on the stack.
+write_decimal:
+	push {r4-r5}
+	sub sp, #12
+	add r4, sp, #12 // end of the digits
+	ldr r5, =0xcccccccd
+	decimal_loop:
+		umull r2, r3, r0, r5
+		mov r3, r3, lsr #3 // r0 / 10
+		add r2, r3, r3, lsl #2
+		sub r2, r0, r2, lsl #1 // r0 % 10
+		add r2, #'0'
+		strb r2, [r4, #-1]!
+		movs r0, r3
+		bne decimal_loop
+	add r5, sp, #12
+	decimal_copy_loop:
+		ldrb r2, [r4], #1
+		strb r2, [r1], #1
+		cmp r4, r5
+		bne decimal_copy_loop
+	add sp, #12
+	pop {r4-r5}
+	bx lr
+
+palindrome_found:
+	// Switch on only the 5 rightmost LEDs
+	// Write 'Palindrome detected' to UART
+	ldr r0, =0xff200000 // led address
+	mov r1, #0x1f // 0b0000011111 led code
+    str r1, [r0]  // write led code
+	ldr r0, =found_output // set string param
+	b write_res // write string
+
+
+palindrome_not_found:
+	ldr r0, =0xff200000 //led code
+	mov r1, #0xfe0 // 0b1111100000
+    str r1, [r0] // write led code
+	ldr r0, =not_found_output
+	b write_res // write string
+
+write_res:
+	mov r1, #0 // used for word counter
+	ldr r2, =0xff201000 // jtag uart address
+	write_loop:
+		ldrb r3, [r0, r1] // load char
+		str r3, [r2] // write char
+		cmp r3, #0   // have we reach termination
+		beq exit    // if so exit
+		add r1, #1  // if not increment counter
+		b write_loop // repeat
+
+
+exit:
+	// Branch here for exit
+	b exit
+
+
+.section .data
+.align
+	// 0: check whether the whole input is a palindrome
+	// 1: find the longest palindromic substring of the input
+	mode: .word 0
+	// This is the input you are supposed to check for a palindrome
+	// You can modify the string during development, however you
+	// are not allowed to change the label 'input'!
+	input: .asciz "level"
+	found_output: .asciz "Palindrome detected"
+	not_found_output: .asciz "Not a palindrome"
+	longest_output: .asciz "Longest palindrome "
+	too_long_output: .asciz "Input too long"
+	// input: .asciz "8448"
+    // input: .asciz "KayAk"
+    // input: .asciz "step on no pets"
+    // input: .asciz "Never odd or even"
+
+.section .bss
+.align
+	pos_map: .space 4 * max_length // offset in input of every char kept by compact
+	radius_odd: .space 4 * max_length
+	radius_even: .space 4 * max_length
+	result_output: .space max_length + 64
+
+
+.end
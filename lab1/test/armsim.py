@@ -0,0 +1,295 @@
+"""Runs the lab 1 programs off the board.
+
+Assembles and links a source with an ARM toolchain, then interprets the ELF
+with the DE1-SoC JTAG UART and red LEDs stubbed out as plain MMIO registers.
+Only the ARM (not Thumb) instructions the lab programs use are implemented;
+anything else raises, so a wrong answer never comes from a silently skipped
+instruction. A branch to itself ends the program, like the board's exit loop.
+
+The toolchain is arm-none-eabi-as/ld if installed, else llvm-mc/ld.lld.
+ARM_AS and ARM_LD override either one with a full command line, e.g.
+ARM_LD="rust-lld -flavor gnu".
+"""
+
+import os
+import shlex
+import shutil
+import struct
+import subprocess
+import tempfile
+
+UART_DATA = 0xff201000
+LED_DATA = 0xff200000
+STACK_TOP = 0x800000
+
+MASK = 0xffffffff
+
+
+class Result:
+    def __init__(self, uart, led, instructions):
+        self.uart = uart                  # bytes written to the UART
+        self.led = led                    # last value written to the LEDs
+        self.instructions = instructions  # instructions executed
+
+
+def _command(variable, candidates):
+    if os.environ.get(variable):
+        return shlex.split(os.environ[variable])
+    for candidate in candidates:
+        if shutil.which(candidate[0]):
+            return list(candidate)
+    raise RuntimeError('no ARM toolchain found, set %s' % variable)
+
+
+def assemble(source, workdir):
+    """Assembles and links the source text, returns the path of the ELF."""
+    asm = _command('ARM_AS', [('arm-none-eabi-as', '-mcpu=cortex-a9'),
+                              ('llvm-mc', '-triple=armv7a-none-eabi', '-mcpu=cortex-a9',
+                               '-filetype=obj')])
+    ld = _command('ARM_LD', [('arm-none-eabi-ld',), ('ld.lld',)])
+    src = os.path.join(workdir, 'prog.s')
+    obj = os.path.join(workdir, 'prog.o')
+    elf = os.path.join(workdir, 'prog.elf')
+    with open(src, 'w') as f:
+        f.write(source)
+    subprocess.run(asm + [src, '-o', obj], check=True)
+    subprocess.run(ld + ['-Ttext=0x1000', '-Tdata=0x100000', '-e', '_start', obj, '-o', elf],
+                   check=True)
+    return elf
+
+
+def load(path):
+    """Returns the memory image of an ELF as {address: byte} and its symbols."""
+    with open(path, 'rb') as f:
+        data = f.read()
+    if data[:4] != b'\x7fELF' or data[4] != 1 or data[5] != 1:
+        raise RuntimeError('%s is not a little endian ELF32 file' % path)
+    shoff, = struct.unpack_from('<I', data, 0x20)
+    shentsize, shnum = struct.unpack_from('<HH', data, 0x2e)
+    sections = [struct.unpack_from('<10I', data, shoff + i * shentsize) for i in range(shnum)]
+
+    memory = {}
+    symbols = {}
+    for _, kind, flags, addr, offset, size, link, _, _, entsize in sections:
+        if kind == 1 and flags & 2:  # allocated PROGBITS, .bss reads as zero anyway
+            for i, byte in enumerate(data[offset:offset + size]):
+                memory[addr + i] = byte
+        elif kind == 2:  # SYMTAB
+            strtab = sections[link]
+            for at in range(offset, offset + size, entsize):
+                name, value = struct.unpack_from('<II', data, at)
+                start = strtab[4] + name
+                symbol = data[start:data.index(b'\0', start)].decode()
+                if symbol:
+                    symbols[symbol] = value
+    return memory, symbols
+
+
+def _ror(value, amount):
+    amount &= 31
+    return ((value >> amount) | (value << (32 - amount))) & MASK if amount else value
+
+
+def _shift(value, kind, amount, carry, by_register):
+    """Barrel shifter, returns the shifted value and its carry out."""
+    if amount == 0 and by_register:
+        return value, carry
+    if kind == 0:  # lsl
+        if amount == 0:
+            return value, carry
+        if amount < 32:
+            return (value << amount) & MASK, (value >> (32 - amount)) & 1
+        return 0, value & 1 if amount == 32 else 0
+    if kind == 1:  # lsr, #0 encodes #32
+        amount = amount or 32
+        if amount < 32:
+            return value >> amount, (value >> (amount - 1)) & 1
+        return 0, value >> 31 if amount == 32 else 0
+    if kind == 2:  # asr, #0 encodes #32
+        amount = amount or 32
+        signed = value - (1 << 32) if value >> 31 else value
+        if amount >= 32:
+            result = MASK if signed < 0 else 0
+            return result, result & 1
+        return (signed >> amount) & MASK, (signed >> (amount - 1)) & 1
+    if amount == 0:  # rrx
+        return (carry << 31) | (value >> 1), value & 1
+    result = _ror(value, amount)
+    return result, result >> 31
+
+
+def run(memory, symbols, limit=100000000):
+    """Runs from _start until the program branches to itself."""
+    reg = [0] * 16
+    reg[13] = STACK_TOP
+    pc = symbols['_start']
+    n = z = c = v = 0
+    uart = bytearray()
+    led = None
+    count = 0
+
+    def read32(address):
+        if address & 3:
+            raise RuntimeError('unaligned word read at %#x' % address)
+        get = memory.get
+        return get(address, 0) | get(address + 1, 0) << 8 | get(address + 2, 0) << 16 | \
+            get(address + 3, 0) << 24
+
+    def write(address, value, size):
+        nonlocal led
+        if address == UART_DATA:
+            uart.append(value & 0xff)
+        elif address == LED_DATA:
+            led = value
+        elif size == 1:
+            memory[address] = value & 0xff
+        elif address & 3:
+            raise RuntimeError('unaligned word write at %#x' % address)
+        else:
+            for i in range(4):
+                memory[address + i] = (value >> 8 * i) & 0xff
+
+    def add(x, y, carry_in):
+        total = x + y + carry_in
+        result = total & MASK
+        return result, total >> 32, (((x ^ result) & (y ^ result)) >> 31) & 1
+
+    while True:
+        count += 1
+        if count > limit:
+            raise RuntimeError('no exit after %d instructions' % limit)
+        ins = read32(pc)
+        reg[15] = pc + 8  # what reads of pc see
+        nxt = pc + 4
+        passed = (z, not z, c, not c, n, not n, v, not v, c and not z, not c or z,
+                  n == v, n != v, not z and n == v, z or n != v, 1, 1)[ins >> 28]
+        if not passed:
+            pc = nxt
+            continue
+
+        if ins & 0x0fe000f0 == 0x00800090:  # umull
+            product = reg[ins & 15] * reg[(ins >> 8) & 15]
+            reg[(ins >> 12) & 15] = product & MASK
+            reg[(ins >> 16) & 15] = product >> 32
+        elif ins & 0x0fff0ff0 == 0x06bf0f30:  # rev
+            reg[(ins >> 12) & 15] = struct.unpack('<I', struct.pack('>I', reg[ins & 15]))[0]
+        elif ins & 0x0ffffff0 == 0x012fff10:  # bx
+            nxt = reg[ins & 15] & ~1
+        elif (ins >> 25) & 7 == 5:  # b, bl
+            offset = ins & 0xffffff
+            if offset & 0x800000:
+                offset -= 1 << 24
+            target = (pc + 8 + offset * 4) & MASK
+            if ins & (1 << 24):
+                reg[14] = pc + 4
+            if target == pc:
+                break
+            nxt = target
+        elif (ins >> 25) & 7 == 4:  # ldm, stm
+            pre, up, _, writeback, is_load = [(ins >> b) & 1 for b in (24, 23, 22, 21, 20)]
+            rn = (ins >> 16) & 15
+            regs = [r for r in range(16) if ins >> r & 1]
+            base = reg[rn]
+            address = base if up else base - 4 * len(regs)
+            if pre == up:
+                address += 4
+            for r in regs:
+                if is_load:
+                    value = read32(address)
+                    if r == 15:
+                        nxt = value & ~1
+                    else:
+                        reg[r] = value
+                else:
+                    write(address, reg[r] if r != 15 else pc + 8, 4)
+                address += 4
+            if writeback:
+                reg[rn] = (base + 4 * len(regs) if up else base - 4 * len(regs)) & MASK
+        elif (ins >> 26) & 3 == 1:  # ldr, str, ldrb, strb
+            shifted, pre, up, byte, writeback, is_load = \
+                [(ins >> b) & 1 for b in (25, 24, 23, 22, 21, 20)]
+            rn = (ins >> 16) & 15
+            rd = (ins >> 12) & 15
+            if shifted:
+                offset, _ = _shift(reg[ins & 15], (ins >> 5) & 3, (ins >> 7) & 31, c, False)
+            else:
+                offset = ins & 0xfff
+            base = reg[rn]
+            indexed = (base + offset if up else base - offset) & MASK
+            address = indexed if pre else base
+            if is_load:
+                value = memory.get(address, 0) if byte else read32(address)
+                if rd == 15:
+                    nxt = value
+                else:
+                    reg[rd] = value
+            else:
+                write(address, reg[rd], 1 if byte else 4)
+            if not pre or writeback:
+                reg[rn] = indexed
+        elif (ins >> 26) & 3 == 0:  # data processing, movw, movt
+            op = (ins >> 21) & 15
+            rn = (ins >> 16) & 15
+            rd = (ins >> 12) & 15
+            if ins & 0x0fb00000 == 0x03000000:
+                imm = ((ins >> 4) & 0xf000) | (ins & 0xfff)
+                reg[rd] = imm if op == 8 else (reg[rd] & 0xffff) | (imm << 16)
+                pc = nxt
+                continue
+            if (ins >> 25) & 1:
+                rotate = ((ins >> 8) & 15) * 2
+                operand = _ror(ins & 0xff, rotate)
+                shift_carry = operand >> 31 if rotate else c
+            elif (ins >> 4) & 1:
+                if (ins >> 7) & 1:
+                    raise RuntimeError('unsupported instruction %08x at %#x' % (ins, pc))
+                operand, shift_carry = _shift(reg[ins & 15], (ins >> 5) & 3,
+                                              reg[(ins >> 8) & 15] & 0xff, c, True)
+            else:
+                operand, shift_carry = _shift(reg[ins & 15], (ins >> 5) & 3,
+                                              (ins >> 7) & 31, c, False)
+            a = reg[rn]
+            arithmetic = True
+            if op in (0, 8):  # and, tst
+                result, arithmetic = a & operand, False
+            elif op in (1, 9):  # eor, teq
+                result, arithmetic = a ^ operand, False
+            elif op in (2, 10):  # sub, cmp
+                result, carry, overflow = add(a, ~operand & MASK, 1)
+            elif op == 3:  # rsb
+                result, carry, overflow = add(operand, ~a & MASK, 1)
+            elif op in (4, 11):  # add, cmn
+                result, carry, overflow = add(a, operand, 0)
+            elif op == 12:  # orr
+                result, arithmetic = a | operand, False
+            elif op == 13:  # mov
+                result, arithmetic = operand, False
+            elif op == 14:  # bic
+                result, arithmetic = a & ~operand & MASK, False
+            elif op == 15:  # mvn
+                result, arithmetic = ~operand & MASK, False
+            else:
+                raise RuntimeError('unsupported instruction %08x at %#x' % (ins, pc))
+            if (ins >> 20) & 1:
+                n = result >> 31
+                z = int(result == 0)
+                if arithmetic:
+                    c, v = carry, overflow
+                else:
+                    c = shift_carry
+            if not 8 <= op <= 11:
+                if rd == 15:
+                    nxt = result
+                else:
+                    reg[rd] = result
+        else:
+            raise RuntimeError('unsupported instruction %08x at %#x' % (ins, pc))
+        pc = nxt
+    return Result(bytes(uart), led, count)
+
+
+def run_source(source, limit=100000000):
+    """Assembles the source text and runs it."""
+    with tempfile.TemporaryDirectory() as workdir:
+        memory, symbols = load(assemble(source, workdir))
+    return run(memory, symbols, limit)
@@ -0,0 +1,174 @@
+#!/usr/bin/env python3
+"""Checks palin_finder.s against a Python reference and its baseline.
+
+Every input is assembled into the program's input label and run with
+armsim.py. The result on the UART and LEDs must match the reference, for
+palin_finder.s and for palin_finder_baseline.s (the version before the word
+at a time check). On long palindromes palin_finder.s must also execute
+fewer instructions than the baseline; the counts are printed for both.
+
+Mode 1 (longest palindromic substring) is checked against a naive O(n^2)
+search, on short random inputs and on inputs of several KB.
+
+Usage: test_palin_finder.py [--seed N] [--cases N]
+"""
+
+import argparse
+import os
+import random
+import re
+import sys
+
+import armsim
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+PROGRAM = os.path.join(HERE, '..', 'palin_finder.s')
+BASELINE = os.path.join(HERE, 'palin_finder_baseline.s')
+
+FOUND = ('Palindrome detected', 0x1f)
+NOT_FOUND = ('Not a palindrome', 0xfe0)
+
+
+def with_input(source, text):
+    escaped = text.replace('\\', '\\\\').replace('"', '\\"')
+    return re.sub(r'input: \.asciz ".*?"', lambda _: 'input: .asciz "%s"' % escaped, source,
+                  count=1)
+
+
+def with_mode(source, mode):
+    return source.replace('mode: .word 0', 'mode: .word %d' % mode, 1)
+
+
+def run(source, text):
+    result = armsim.run_source(with_input(source, text), limit=1000000000)
+    # the terminator goes out on the UART too
+    return result.uart.rstrip(b'\0').decode(), result.led, result.instructions
+
+
+def lowered(text):
+    return ''.join(chr(ord(ch) + 32) if 'A' <= ch <= 'Z' else ch for ch in text)
+
+
+def is_palindrome(text):
+    kept = lowered(text).replace(' ', '')
+    return kept == kept[::-1]
+
+
+def longest_palindrome(text):
+    """The expected UART text and LEDs of mode 1, by expanding every center."""
+    kept = [(offset, ch) for offset, ch in enumerate(lowered(text)) if ch != ' ']
+    chars = ''.join(ch for _, ch in kept)
+    if not chars:
+        return NOT_FOUND
+    start, length = 0, 1
+    for center in range(2 * len(chars) - 1):
+        low, high = center // 2, (center + 1) // 2
+        while low >= 0 and high < len(chars) and chars[low] == chars[high]:
+            low -= 1
+            high += 1
+        # strictly longer, so the leftmost of equally long ones wins
+        if high - low - 1 > length:
+            start, length = low + 1, high - low - 1
+    output = 'Longest palindrome %d-%d: %s' % (kept[start][0], kept[start + length - 1][0],
+                                               chars[start:start + length])
+    return output, min(length, 0x3ff)
+
+
+def random_input(rng):
+    # neighbours of 'A'-'Z' and 'a'-'z' catch off by one case folding
+    half = ''.join(rng.choice('aAbB c@[`{Zz') for _ in range(rng.randint(0, 20)))
+    if rng.random() < 0.6:
+        middle = rng.choice(['', 'x', ' '])
+        text = half + middle + ''.join(rng.choice([ch, ch.swapcase()]) for ch in half[::-1])
+        text = ''.join(ch + ' ' if rng.random() < 0.1 else ch for ch in text)
+    else:
+        text = half
+    return text.strip() or 'q'
+
+
+def check_mode0(sources, rng, cases):
+    inputs = ['level', '8448', 'KayAk', 'step on no pets', 'Never odd or even', 'a', 'ab',
+              'aa', 'a b', 'ABba', 'Aa@', 'x' * 7, 'xy' * 9]
+    inputs += [random_input(rng) for _ in range(cases)]
+    failures = 0
+    for text in inputs:
+        expected = FOUND if is_palindrome(text) else NOT_FOUND
+        for name, source in sources:
+            output, led, _ = run(source, text)
+            if (output, led) != expected:
+                failures += 1
+                print('FAIL %s %r: %r, LEDs %s, expected %r, LEDs %#x' %
+                      (name, text, output, led if led is None else hex(led), *expected))
+    print('mode 0: %d inputs, %d failures' % (len(inputs), failures))
+    return failures
+
+
+def check_instructions(sources, rng):
+    failures = 0
+    print('%8s %12s %12s %7s' % ('length', 'baseline', 'current', 'speedup'))
+    for length in (64, 1024, 4096):
+        half = ''.join(rng.choice('abcdefgh ABC') for _ in range(length // 2)).strip()
+        text = half + ''.join(ch.swapcase() for ch in half[::-1])
+        baseline = run(sources['baseline'], text)[2]
+        current = run(sources['palin_finder'], text)[2]
+        print('%8d %12d %12d %6.2fx' % (len(text), baseline, current, baseline / current))
+        if current >= baseline:
+            failures += 1
+            print('FAIL %d chars take more instructions than the baseline' % len(text))
+    return failures
+
+
+def check_mode1(source, rng, cases):
+    source = with_mode(source, 1)
+    inputs = ['level', 'KayAk', 'Never odd or even', 'a', 'ab', 'abba', 'x abc', '   ',
+              'ab  A', 'abacdfgdcaba', 'forgeeksskeegfor']
+    for _ in range(cases):
+        alphabet = rng.choice(['ab', 'abA ', 'abcB', 'aaaa b'])
+        inputs.append(''.join(rng.choice(alphabet) for _ in range(rng.randint(1, 60))))
+    # several KB, long enough for a quadratic program to show in the counts
+    for length in (1024, 4096, 8192):
+        inputs.append(''.join(rng.choice('ab') for _ in range(length)))
+        inputs.append(''.join(rng.choice('aaaAb  ') for _ in range(length)))
+    inputs.append('a' * 4096)
+    failures = 0
+    for text in inputs:
+        output, led, instructions = run(source, text)
+        expected = longest_palindrome(text)
+        if (output, led) != expected:
+            failures += 1
+            print('FAIL mode 1 %r: %r, LEDs %s, expected %r, LEDs %#x' %
+                  (text[:80], output[:80], led if led is None else hex(led), expected[0][:80],
+                   expected[1]))
+        elif len(text) >= 1024:
+            print('mode 1: %5d chars, %8d instructions, %5.1f per char' %
+                  (len(text), instructions, instructions / len(text)))
+
+    max_length = int(re.search(r'\.equ max_length, (\d+)', source).group(1))
+    output, led, _ = run(source, 'a' * (max_length + 1))
+    if (output, led) != ('Input too long', 0xfe0):
+        failures += 1
+        print('FAIL mode 1 on %d chars: %r, LEDs %s' % (max_length + 1, output, led))
+    print('mode 1: %d inputs, %d failures' % (len(inputs) + 1, failures))
+    return failures
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--seed', type=int, default=1)
+    parser.add_argument('--cases', type=int, default=200, help='random inputs per mode')
+    args = parser.parse_args()
+    rng = random.Random(args.seed)
+
+    sources = {}
+    for name, path in (('palin_finder', PROGRAM), ('baseline', BASELINE)):
+        with open(path) as f:
+            sources[name] = f.read()
+
+    failures = check_mode0(sources.items(), rng, args.cases)
+    failures += check_instructions(sources, rng)
+    failures += check_mode1(sources['palin_finder'], rng, args.cases)
+    return 1 if failures else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
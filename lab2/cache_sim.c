@@ -1,24 +1,54 @@
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 
 typedef enum { dm, fa } cache_map_t;
 typedef enum { uc, sc } cache_org_t;
 typedef enum { instruction, data } access_t;
+typedef enum { no_side_cache, victim_cache, miss_cache } side_cache_t;
+typedef enum { mesi, moesi } coherence_protocol_t;
+// coherence state of a line, kept in the low bits of the cache line below the
+// tag. lines of a single core cache stay in coh_invalid
+typedef enum {
+  coh_invalid,
+  coh_shared,
+  coh_exclusive,
+  coh_owned,
+  coh_modified
+} coherence_state_t;
 typedef struct fifo_node_t fifo_node_t;
 
 typedef struct {
   uint32_t address;
   access_t accesstype;
+  // issuing core and read/write, only used by the coherence simulation
+  uint8_t core;
+  bool write;
 } mem_access_t;
 
 typedef struct {
   uint64_t accesses;
   uint64_t hits;
+  // hits served by the victim/miss cache, these are included in hits
+  uint64_t side_hits;
+  // accesses the prefilter credited as hits without a lookup
+  uint64_t coalesced;
   // You can declare additional statistics if
   // you like, however you are now allowed to
   // remove the accesses or hits
@@ -39,17 +69,60 @@ typedef struct {
   cache_org_t cache_org;
 } cache_info_t;
 
+/**
+ * Small fully associative buffer behind the cache array. Entries use the same
+ * validity and instruction bits as cache lines, but hold the whole block
+ * address (address >> block offset bits) in the low bits since they are not
+ * tied to an index. Replacement is fifo through next.
+ */
+typedef struct {
+  uint32_t *data;
+  uint8_t num_entries;
+  uint8_t next;
+  uint64_t hits;
+} side_cache_data_t;
+
 typedef struct {
   // contains info for each cache line
   uint32_t *data;
   // replacement policy
   fifo_node_t *queue;
+  // victim or miss cache, num_entries is 0 if disabled
+  side_cache_data_t side;
+  // evicted lines in modified or owned state
+  uint64_t dirty_evictions;
 } cache_data_t;
 
+/**
+ * Set associative TLB with lru replacement. Entries hold the virtual page
+ * number | 0x80000000 when valid, last_used the time of the last hit.
+ */
+typedef struct {
+  uint32_t *entries;
+  uint64_t *last_used;
+  uint16_t num_sets;
+  uint8_t ways;
+  uint64_t accesses;
+  uint64_t hits;
+} tlb_t;
+
+// split L1 TLBs backed by a unified L2 TLB (ways is 0 if there is none)
+typedef struct {
+  tlb_t itlb;
+  tlb_t dtlb;
+  tlb_t l2_tlb;
+  uint64_t clock;
+  uint64_t walks;
+  // cycles spent on translation beyond the L1 TLB hit latency
+  uint64_t cycles;
+} mmu_t;
+
 typedef struct {
   cache_info_t cache_info;
   cache_data_t data_cache;
   cache_data_t instruction_cache;
+  // translation in front of the cache, NULL if not simulated
+  mmu_t *mmu;
 } cache_t;
 
 // DECLARE CACHES AND COUNTERS FOR THE STATS HERE
@@ -58,6 +131,35 @@ uint32_t cache_size;
 uint32_t block_size = 64;
 cache_map_t cache_mapping;
 cache_org_t cache_org;
+// number of worker threads the trace is partitioned over (by set index)
+unsigned num_threads = 1;
+side_cache_t side_cache = no_side_cache;
+uint8_t side_cache_entries = 0;
+// more than one core enables the coherence simulation
+unsigned num_cores = 1;
+coherence_protocol_t coherence_protocol = mesi;
+// TLB configuration, the defaults are used if only --tlb is given
+bool tlb_enabled = false;
+uint16_t l1_tlb_entries = 64;
+uint8_t l1_tlb_ways = 4;
+uint16_t l2_tlb_entries = 1024;
+uint8_t l2_tlb_ways = 8;
+// 4K pages, 21 for 2M and 30 for 1G
+uint8_t page_offset_bits = 12;
+// cost of an L2 TLB lookup and of every page table level read in a walk
+unsigned l2_tlb_cycles = 7;
+unsigned walk_cycles = 30;
+// use the specialized kernels where possible
+bool use_kernels = true;
+// threads parsing the trace in chunks, 0 reads it serially
+unsigned parse_threads = 0;
+// collapse runs of accesses to the same line before simulating them
+bool coalesce = false;
+// time the phases of the simulation and report them after the statistics
+bool profile = false;
+// shared memory names of --server and --client, NULL for a normal run
+const char *server_name = NULL;
+const char *client_name = NULL;
 
 static uint8_t mylog2(uint32_t val) {
   unsigned int ret = 0;
@@ -71,33 +173,127 @@ static uint8_t mylog2(uint32_t val) {
 // USE THIS FOR YOUR CACHE STATISTICS
 cache_stat_t cache_statistics;
 
+/*
+ * Profiling.
+ *
+ * --profile times trace parsing, lookups and inserts with the time stamp
+ * counter (clock_gettime where there is none). The ticks are kept per thread
+ * and added to the totals when a thread is done with the trace. Parsing is
+ * timed per batch. Lookups and inserts are timed in 1 of PROFILE_SAMPLE
+ * accesses and scaled up; timing every access takes longer than the lookup.
+ */
+typedef enum { parse_phase, lookup_phase, insert_phase, num_phases } phase_t;
+
+#if defined(__x86_64__) || defined(__i386__)
+#define PROFILE_UNIT "cycles"
+static inline uint64_t profile_clock(void) { return __rdtsc(); }
+#else
+#define PROFILE_UNIT "ns"
+static inline uint64_t profile_clock(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+#endif
+
+__thread uint64_t phase_ticks[num_phases];
+uint64_t total_phase_ticks[num_phases];
+
+#define PROFILE_SAMPLE 64
+__thread uint32_t profile_accesses;
+
+// whether to time the phases of this access
+static inline bool profile_sample(void) {
+  return profile && ++profile_accesses % PROFILE_SAMPLE == 0;
+}
+
+#define PROFILE_PHASE(sampled, phase, statement)                \
+  do {                                                          \
+    if (sampled) {                                              \
+      uint64_t profile_start = profile_clock();                 \
+      statement;                                                \
+      uint64_t profile_ticks = profile_clock() - profile_start; \
+      phase_ticks[phase] += profile_ticks * PROFILE_SAMPLE;     \
+    } else {                                                    \
+      statement;                                                \
+    }                                                           \
+  } while (0)
+
+// called by every thread that simulated part of the trace when it is done
+void collect_phase_ticks(void) {
+  for (int i = 0; i < num_phases; ++i) {
+    __atomic_add_fetch(&total_phase_ticks[i], phase_ticks[i], __ATOMIC_RELAXED);
+    phase_ticks[i] = 0;
+  }
+}
+
+// the simulator allocates through these so --profile can count allocations
+uint64_t malloc_count;
+
+static inline void count_allocation(void) {
+  if (profile) {
+    __atomic_add_fetch(&malloc_count, 1, __ATOMIC_RELAXED);
+  }
+}
+
+static inline void *sim_malloc(size_t size) {
+  count_allocation();
+  return malloc(size);
+}
+
+static inline void *sim_calloc(size_t count, size_t size) {
+  count_allocation();
+  return calloc(count, size);
+}
+
+static inline void *sim_realloc(void *pointer, size_t size) {
+  count_allocation();
+  return realloc(pointer, size);
+}
+
 /* Reads a memory access from the trace file and returns
  * 1) access type (instruction or data access
  * 2) memory address
+ * 3) optionally the core id and a w for writes, e.g. "D 8cda3fa8 2 w"
  */
-mem_access_t read_transaction(FILE *ptr_file) {
-  char buf[1000];
+mem_access_t parse_transaction(char *string) {
   char *token;
-  char *string = buf;
   mem_access_t access;
 
-  if (fgets(buf, 1000, ptr_file) != NULL) {
-    /* Get the access type */
-    token = strsep(&string, " \n");
-    if (strcmp(token, "I") == 0) {
-      access.accesstype = instruction;
-    } else if (strcmp(token, "D") == 0) {
-      access.accesstype = data;
-    } else {
-      printf("Unkown access type\n");
-      exit(0);
+  /* Get the access type */
+  token = strsep(&string, " \n");
+  if (strcmp(token, "I") == 0) {
+    access.accesstype = instruction;
+  } else if (strcmp(token, "D") == 0) {
+    access.accesstype = data;
+  } else {
+    printf("Unkown access type\n");
+    exit(0);
+  }
+
+  /* Get the access type */
+  token = strsep(&string, " \n");
+  access.address = (uint32_t)strtol(token, NULL, 16);
+
+  access.core = 0;
+  access.write = false;
+  while ((token = strsep(&string, " \n")) != NULL) {
+    if (*token == 'w' || *token == 'W') {
+      access.write = true;
+    } else if (*token >= '0' && *token <= '9') {
+      access.core = atoi(token);
     }
+  }
+
+  return access;
+}
 
-    /* Get the access type */
-    token = strsep(&string, " \n");
-    access.address = (uint32_t)strtol(token, NULL, 16);
+mem_access_t read_transaction(FILE *ptr_file) {
+  char buf[1000];
+  mem_access_t access;
 
-    return access;
+  if (fgets(buf, 1000, ptr_file) != NULL) {
+    return parse_transaction(buf);
   }
 
   /* If there are no more entries in the file,
@@ -148,6 +344,71 @@ uint32_t get_cache_tag(cache_info_t cache_info, uint32_t line_info) {
 // checks validity bit
 bool is_valid(uint32_t line_info) { return line_info & 0x80000000; }
 
+access_t get_cache_line_access_type(uint32_t cache_line) {
+  return (cache_line & 0x40000000) ? instruction : data;
+}
+
+uint32_t get_block_address(cache_info_t cache_info, uint32_t address) {
+  return address >> cache_info.num_block_offset_bits;
+}
+
+// returns UINT8_MAX if block is not in the side cache, otherwise its entry
+uint8_t get_side_index_if_present(side_cache_data_t *side, uint32_t block,
+                                  access_t accesstype) {
+  uint32_t wanted = block | 0x80000000;
+  if (accesstype == instruction) {
+    wanted |= 0x40000000;
+  }
+  for (uint8_t i = 0; i < side->num_entries; ++i) {
+    if (side->data[i] == wanted) {
+      return i;
+    }
+  }
+  return UINT8_MAX;
+}
+
+// puts a line in the side cache, using an empty entry if there is one
+void insert_side(side_cache_data_t *side, uint32_t block,
+                 access_t accesstype) {
+  uint8_t ix = side->next;
+  for (uint8_t i = 0; i < side->num_entries; ++i) {
+    if (!is_valid(side->data[i])) {
+      ix = i;
+      break;
+    }
+  }
+  if (ix == side->next) {
+    side->next = (side->next + 1) % side->num_entries;
+  }
+  side->data[ix] = block | ((accesstype == instruction) ? 0xC0000000 : 0x80000000);
+}
+
+coherence_state_t get_line_state(uint32_t line_info) {
+  return line_info & 0x7;
+}
+
+void set_line_state(cache_data_t *cache, uint8_t index,
+                    coherence_state_t state) {
+  cache->data[index] = (cache->data[index] & ~0x7) | state;
+}
+
+// called with the line about to be overwritten at index of a cache
+void evict_line(cache_data_t *cache, cache_info_t cache_info, uint8_t index) {
+  uint32_t line = cache->data[index];
+  // with --threads the set workers share the caches of the cores
+  if (is_valid(line) && get_line_state(line) >= coh_owned) {
+    __atomic_add_fetch(&cache->dirty_evictions, 1, __ATOMIC_RELAXED);
+  }
+  if (side_cache != victim_cache || !is_valid(line)) {
+    return;
+  }
+  uint32_t block = get_cache_tag(cache_info, line) << cache_info.num_index_bits;
+  if (cache_info.cache_mapping == dm) {
+    block |= index;
+  }
+  insert_side(&cache->side, block, get_cache_line_access_type(line));
+}
+
 /**
  * Used to insert data into given cache, works for both dm and fa mappings
  */
@@ -160,6 +421,7 @@ void insert_access(cache_data_t *cache, cache_info_t cache_info,
                                << (32 - 2 - cache_info.num_tag_bits);
 
     uint32_t index = get_dm_index(cache_info, access.address);
+    evict_line(cache, cache_info, index);
     // set access tag
     cache->data[index] = shifted_acc_tag;
     // set validity bit
@@ -168,13 +430,14 @@ void insert_access(cache_data_t *cache, cache_info_t cache_info,
     uint32_t shifted_acc_tag = get_access_tag(cache_info, access)
                                << (32 - 2 - cache_info.num_tag_bits);
     uint8_t index = get_next_fa_index(cache, cache_info);
+    evict_line(cache, cache_info, index);
     // set tag
     cache->data[index] = shifted_acc_tag;
     // set validity bit
     cache->data[index] |= validity_and_instruction_bits;
 
     // add new item to fifo queue
-    fifo_node_t *next_item = malloc(sizeof(fifo_node_t));
+    fifo_node_t *next_item = sim_malloc(sizeof(fifo_node_t));
     *next_item = (fifo_node_t){.next = NULL, .index = index};
 
     if (cache->queue) {
@@ -212,10 +475,6 @@ void remove_index_from_cache(cache_data_t *cache, uint8_t index) {
 }
 
 
-access_t get_cache_line_access_type(uint32_t cache_line) {
-  return (cache_line & 0x40000000) ? instruction : data;
-}
-
 /**
  * Checks whether or not a given data_cache line contains data for the given
  * access
@@ -262,7 +521,10 @@ uint8_t get_index_if_present(cache_data_t *cache, cache_info_t cache_info,
 //  if present in other but not this, it is removed from other
 bool perform_lookup(cache_data_t *this_cache, cache_data_t *other_cache,
                     cache_info_t cache_info, mem_access_t access) {
-  uint8_t res = get_index_if_present(this_cache, cache_info, access);
+  uint8_t res;
+  bool sampled = profile_sample();
+  PROFILE_PHASE(sampled, lookup_phase,
+                res = get_index_if_present(this_cache, cache_info, access));
   // if cache miss
   if (res == UINT8_MAX) {
     uint8_t other_res;
@@ -272,39 +534,1587 @@ bool perform_lookup(cache_data_t *this_cache, cache_data_t *other_cache,
     cache_data_t *removed_from;
     // if split cache we want to check other cache for conflicting data
     if (cache_info.cache_org == sc) {
-      other_res = get_index_if_present(other_cache, cache_info, access);
+      PROFILE_PHASE(sampled, lookup_phase, other_res = get_index_if_present(
+                                      other_cache, cache_info, access));
       removed_from = other_cache;
     }
     // if unified cache we want to check the same cache for conflict
     else {
-      other_res = get_index_if_present(this_cache, cache_info, access);
+      PROFILE_PHASE(sampled, lookup_phase, other_res = get_index_if_present(
+                                      this_cache, cache_info, access));
       removed_from = this_cache;
     }
     // found conflict
     if (other_res != UINT8_MAX) {
       remove_index_from_cache(removed_from, other_res);
     }
+    uint32_t block = get_block_address(cache_info, access.address);
+    if (removed_from->side.num_entries) {
+      other_res = get_side_index_if_present(&removed_from->side, block,
+                                            access.accesstype);
+      if (other_res != UINT8_MAX) {
+        removed_from->side.data[other_res] = 0;
+      }
+    }
     access.accesstype = (access.accesstype == instruction) ? data : instruction;
-    insert_access(this_cache, cache_info, access);
+
+    if (this_cache->side.num_entries) {
+      uint8_t side_res = get_side_index_if_present(&this_cache->side, block,
+                                                   access.accesstype);
+      if (side_res != UINT8_MAX) {
+        this_cache->side.hits++;
+        // a victim cache swaps the line back, the freed entry is taken by
+        // whatever the insert evicts. a miss cache keeps its copy
+        if (side_cache == victim_cache) {
+          this_cache->side.data[side_res] = 0;
+        }
+        PROFILE_PHASE(sampled, insert_phase,
+                      insert_access(this_cache, cache_info, access));
+        return true;
+      }
+      if (side_cache == miss_cache) {
+        insert_side(&this_cache->side, block, access.accesstype);
+      }
+    }
+    PROFILE_PHASE(sampled, insert_phase, insert_access(this_cache, cache_info, access));
     return false;
   }
   return true;
 }
 
-bool perform_fetch(cache_t *cache, mem_access_t access) {
-  if (cache->cache_info.cache_org == uc) {
+void init_tlb(tlb_t *tlb, uint16_t entries, uint8_t ways) {
+  *tlb = (tlb_t){
+      .entries = sim_calloc(entries, sizeof(uint32_t)),
+      .last_used = sim_calloc(entries, sizeof(uint64_t)),
+      .num_sets = ways ? entries / ways : 0,
+      .ways = ways,
+  };
+}
+
+// looks up a page and inserts it over the lru entry of its set on a miss
+bool tlb_lookup(tlb_t *tlb, uint32_t page, uint64_t now) {
+  uint32_t key = page | 0x80000000;
+  uint32_t first = (page & (tlb->num_sets - 1)) * tlb->ways;
+  uint32_t lru = first;
+  tlb->accesses++;
+  for (uint32_t i = first; i < first + tlb->ways; ++i) {
+    if (tlb->entries[i] == key) {
+      tlb->last_used[i] = now;
+      tlb->hits++;
+      return true;
+    }
+    if (tlb->last_used[i] < tlb->last_used[lru]) {
+      lru = i;
+    }
+  }
+  tlb->entries[lru] = key;
+  tlb->last_used[lru] = now;
+  return false;
+}
+
+/**
+ * Translates the address of an access before it goes to the cache. Addresses
+ * are identity mapped, only the TLBs and the walk cost are simulated.
+ * A walk reads one entry per page table level, 4 levels for 4K pages, 3 for
+ * 2M and 2 for 1G pages like x86-64.
+ */
+void translate_access(mmu_t *mmu, mem_access_t access) {
+  uint32_t page = access.address >> page_offset_bits;
+  tlb_t *l1_tlb = (access.accesstype == instruction) ? &mmu->itlb : &mmu->dtlb;
+  mmu->clock++;
+  if (tlb_lookup(l1_tlb, page, mmu->clock)) {
+    return;
+  }
+  if (mmu->l2_tlb.ways) {
+    mmu->cycles += l2_tlb_cycles;
+    if (tlb_lookup(&mmu->l2_tlb, page, mmu->clock)) {
+      return;
+    }
+  }
+  uint8_t levels = (page_offset_bits == 12) ? 4 : (page_offset_bits == 21) ? 3 : 2;
+  mmu->walks++;
+  mmu->cycles += levels * walk_cycles;
+}
+
+// the part of the cache an access of the given type is looked up in
+cache_data_t *get_access_cache(cache_t *cache, access_t accesstype) {
+  if (cache->cache_info.cache_org == sc && accesstype == instruction) {
+    return &cache->instruction_cache;
+  }
+  return &cache->data_cache;
+}
+
+// cache_info is passed separately so the kernels can make it a constant
+static inline bool perform_fetch_with_info(cache_t *cache,
+                                           cache_info_t cache_info,
+                                           mem_access_t access) {
+  if (cache_info.cache_org == uc) {
     // unified cache uses only data cache
     return (perform_lookup(&cache->data_cache, &cache->instruction_cache,
-                           cache->cache_info, access));
+                           cache_info, access));
   }
   if (access.accesstype == instruction) {
     // split cache instruction fetch
     return (perform_lookup(&cache->instruction_cache, &cache->data_cache,
-                           cache->cache_info, access));
+                           cache_info, access));
   }
   // split cache data fetch
   return (perform_lookup(&cache->data_cache, &cache->instruction_cache,
-                         cache->cache_info, access));
+                         cache_info, access));
+}
+
+bool perform_fetch(cache_t *cache, mem_access_t access) {
+  return perform_fetch_with_info(cache, cache->cache_info, access);
+}
+
+/*
+ * Multi-core coherence simulation.
+ *
+ * With --cores N every core gets a private cache_t with the same configuration
+ * and is fed the accesses tagged with its core id. The caches are kept coherent
+ * by snooping MESI, or MOESI where a modified line that is read by another core
+ * becomes owned instead of being written back.
+ *
+ * A line record per block tracks which cores lost their copy to a write from
+ * another core and which words of the block were written since. The next miss
+ * of such a core is a coherence miss, and a false sharing miss if the word it
+ * accesses was not one of them.
+ */
+#define MAX_CORES 16
+
+typedef struct {
+  // block address | 0x80000000, 0 for an empty slot
+  uint32_t key;
+  // bit per core whose copy was invalidated by another core
+  uint16_t invalidated;
+  // words (4 bytes each) written by other cores since the copy was lost
+  uint16_t remote_writes[MAX_CORES];
+  uint64_t invalidations;
+  uint64_t coherence_misses;
+  uint64_t false_sharing_misses;
+} line_record_t;
+
+// open addressing hash table of line records, capacity is a power of two
+typedef struct {
+  line_record_t *records;
+  size_t capacity;
+  size_t used;
+} line_table_t;
+
+typedef struct {
+  uint64_t bus_reads;
+  uint64_t bus_read_exclusives;
+  uint64_t bus_upgrades;
+  uint64_t invalidations;
+  // misses served by another cache holding the line modified or owned
+  uint64_t cache_transfers;
+  // modified lines flushed when read by another core (MESI only)
+  uint64_t flushes;
+  uint64_t coherence_misses;
+  uint64_t false_sharing_misses;
+} coherence_stat_t;
+
+typedef struct {
+  cache_t *cores;
+  unsigned num_cores;
+  line_table_t lines;
+  coherence_stat_t stats;
+  cache_stat_t core_stats[MAX_CORES];
+} coherence_t;
+
+void init_line_table(line_table_t *table) {
+  table->capacity = 1024;
+  table->used = 0;
+  table->records = sim_calloc(table->capacity, sizeof(line_record_t));
+}
+
+line_record_t *get_line_record(line_table_t *table, uint32_t block);
+
+void grow_line_table(line_table_t *table) {
+  line_table_t old = *table;
+  table->capacity *= 2;
+  table->used = 0;
+  table->records = sim_calloc(table->capacity, sizeof(line_record_t));
+  for (size_t i = 0; i < old.capacity; ++i) {
+    if (old.records[i].key) {
+      *get_line_record(table, old.records[i].key & ~0x80000000) =
+          old.records[i];
+    }
+  }
+  free(old.records);
+}
+
+// returns the record of a block, adding an empty one if it is not there yet
+line_record_t *get_line_record(line_table_t *table, uint32_t block) {
+  if (table->used * 2 >= table->capacity) {
+    grow_line_table(table);
+  }
+  uint32_t key = block | 0x80000000;
+  size_t mask = table->capacity - 1;
+  size_t i = (block * 2654435761u) & mask;
+  while (table->records[i].key && table->records[i].key != key) {
+    i = (i + 1) & mask;
+  }
+  if (!table->records[i].key) {
+    table->records[i].key = key;
+    table->used++;
+  }
+  return &table->records[i];
+}
+
+// removes the line from every other core, a write is about to happen
+void invalidate_remote_copies(coherence_t *system, mem_access_t access,
+                              line_record_t *line) {
+  for (unsigned core = 0; core < system->num_cores; ++core) {
+    if (core == access.core) continue;
+    cache_t *remote = &system->cores[core];
+    cache_data_t *remote_data = get_access_cache(remote, access.accesstype);
+    uint8_t index =
+        get_index_if_present(remote_data, remote->cache_info, access);
+    if (index == UINT8_MAX) continue;
+    if (get_line_state(remote_data->data[index]) >= coh_owned) {
+      system->stats.cache_transfers++;
+    }
+    remove_index_from_cache(remote_data, index);
+    system->stats.invalidations++;
+    line->invalidations++;
+    line->invalidated |= 1 << core;
+    line->remote_writes[core] = 0;
+  }
+}
+
+// read miss: every other copy ends up shared (or owned), returns if any exist
+bool share_remote_copies(coherence_t *system, mem_access_t access) {
+  bool shared = false;
+  for (unsigned core = 0; core < system->num_cores; ++core) {
+    if (core == access.core) continue;
+    cache_t *remote = &system->cores[core];
+    cache_data_t *remote_data = get_access_cache(remote, access.accesstype);
+    uint8_t index =
+        get_index_if_present(remote_data, remote->cache_info, access);
+    if (index == UINT8_MAX) continue;
+    shared = true;
+    switch (get_line_state(remote_data->data[index])) {
+      case coh_modified:
+        system->stats.cache_transfers++;
+        if (coherence_protocol == moesi) {
+          set_line_state(remote_data, index, coh_owned);
+        } else {
+          system->stats.flushes++;
+          set_line_state(remote_data, index, coh_shared);
+        }
+        break;
+      case coh_owned:
+        system->stats.cache_transfers++;
+        break;
+      case coh_exclusive:
+        set_line_state(remote_data, index, coh_shared);
+        break;
+      default:
+        break;
+    }
+  }
+  return shared;
+}
+
+bool perform_coherent_fetch(coherence_t *system, mem_access_t access) {
+  cache_t *own = &system->cores[access.core];
+  cache_info_t cache_info = own->cache_info;
+  cache_data_t *own_data = get_access_cache(own, access.accesstype);
+  line_record_t *line =
+      get_line_record(&system->lines, get_block_address(cache_info, access.address));
+  uint16_t word = 1 << ((access.address >> 2) & 0xF);
+  bool hit;
+
+  uint8_t index = get_index_if_present(own_data, cache_info, access);
+  if (index != UINT8_MAX) {
+    coherence_state_t state = get_line_state(own_data->data[index]);
+    if (access.write && state != coh_modified) {
+      // exclusive lines are upgraded silently
+      if (state != coh_exclusive) {
+        system->stats.bus_upgrades++;
+        invalidate_remote_copies(system, access, line);
+      }
+      set_line_state(own_data, index, coh_modified);
+    }
+    hit = true;
+  } else {
+    if (line->invalidated & (1 << access.core)) {
+      system->stats.coherence_misses++;
+      line->coherence_misses++;
+      if (!(line->remote_writes[access.core] & word)) {
+        system->stats.false_sharing_misses++;
+        line->false_sharing_misses++;
+      }
+      line->invalidated &= ~(1 << access.core);
+      line->remote_writes[access.core] = 0;
+    }
+
+    coherence_state_t state;
+    if (access.write) {
+      system->stats.bus_read_exclusives++;
+      invalidate_remote_copies(system, access, line);
+      state = coh_modified;
+    } else {
+      system->stats.bus_reads++;
+      state = share_remote_copies(system, access) ? coh_shared : coh_exclusive;
+    }
+    // does the replacement and I/D invalidation within the core
+    perform_fetch(own, access);
+    index = get_index_if_present(own_data, cache_info, access);
+    set_line_state(own_data, index, state);
+    hit = false;
+  }
+
+  if (access.write) {
+    for (unsigned core = 0; core < system->num_cores; ++core) {
+      if (line->invalidated & (1 << core)) {
+        line->remote_writes[core] |= word;
+      }
+    }
+  }
+  return hit;
+}
+
+// accesses are read from the trace and simulated in batches of this size
+#define BATCH_SIZE 65536
+
+/**
+ * Fills batch with up to BATCH_SIZE accesses from the trace file
+ * @return number of accesses read, less than BATCH_SIZE once the trace ends
+ */
+size_t read_batch(FILE *ptr_file, mem_access_t *batch) {
+  uint64_t profile_start = profile ? profile_clock() : 0;
+  size_t count = 0;
+  while (count < BATCH_SIZE) {
+    mem_access_t access = read_transaction(ptr_file);
+    // address 0 terminates the trace, same as the original loop in main
+    if (access.address == 0) break;
+    batch[count++] = access;
+  }
+  if (profile) {
+    phase_ticks[parse_phase] += profile_clock() - profile_start;
+  }
+  return count;
+}
+
+/*
+ * Chunked parallel trace parsing.
+ *
+ * With --parse-threads N the trace is read in CHUNK_SIZE pieces that end at a
+ * newline, the partial last line is carried over to the next chunk. Reading
+ * the file happens in order under the reader lock, parsing the chunk into
+ * accesses happens on N threads in parallel. Chunk i uses slot
+ * i % CHUNK_SLOTS and the simulator takes the slots in order, so at most
+ * CHUNK_SLOTS chunks are in flight and parsing overlaps the simulation.
+ */
+#define CHUNK_SIZE (1 << 20)
+#define CHUNK_SLOTS 16
+
+typedef enum { chunk_free, chunk_parsing, chunk_parsed } chunk_state_t;
+
+typedef struct {
+  // CHUNK_SIZE plus room for the carried over line and a terminating 0
+  char *text;
+  size_t length;
+  mem_access_t *accesses;
+  size_t count;
+  size_t capacity;
+  // end of file, or the chunk contains the address 0 that ends the trace
+  bool last;
+  chunk_state_t state;
+} trace_chunk_t;
+
+typedef struct {
+  FILE *file;
+  pthread_t *threads;
+  unsigned num_threads;
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  trace_chunk_t chunks[CHUNK_SLOTS];
+  // partial line at the end of the previous chunk
+  char *carry;
+  size_t carry_length;
+  uint64_t next_read;
+  uint64_t next_consume;
+  // the simulator holds chunk next_consume until it asks for the next one
+  bool consuming;
+  bool eof;
+  // the last chunk has been handed out, parsers stop reading
+  bool done;
+} chunk_reader_t;
+
+// called with the lock held, chunks have to be read in order
+void read_chunk(chunk_reader_t *reader, trace_chunk_t *chunk) {
+  memcpy(chunk->text, reader->carry, reader->carry_length);
+  size_t length = reader->carry_length +
+                  fread(chunk->text + reader->carry_length, 1, CHUNK_SIZE,
+                        reader->file);
+  chunk->last = false;
+  if (length < reader->carry_length + CHUNK_SIZE) {
+    reader->eof = true;
+    chunk->last = true;
+    reader->carry_length = 0;
+    chunk->length = length;
+    return;
+  }
+  size_t end = length;
+  while (end > 0 && chunk->text[end - 1] != '\n') {
+    end--;
+  }
+  // a single line longer than a chunk is parsed as it is
+  if (end == 0) {
+    end = length;
+  }
+  reader->carry_length = length - end;
+  memcpy(reader->carry, chunk->text + end, reader->carry_length);
+  chunk->length = end;
+}
+
+void parse_chunk(trace_chunk_t *chunk) {
+  uint64_t profile_start = profile ? profile_clock() : 0;
+  char *line = chunk->text;
+  char *end = chunk->text + chunk->length;
+  *end = '\0';
+  chunk->count = 0;
+  while (line < end) {
+    char *newline = memchr(line, '\n', end - line);
+    if (newline) {
+      *newline = '\0';
+    }
+    mem_access_t access = parse_transaction(line);
+    // address 0 terminates the trace, same as read_batch()
+    if (access.address == 0) {
+      chunk->last = true;
+      break;
+    }
+    if (chunk->count == chunk->capacity) {
+      chunk->capacity *= 2;
+      chunk->accesses =
+          sim_realloc(chunk->accesses, chunk->capacity * sizeof(mem_access_t));
+    }
+    chunk->accesses[chunk->count++] = access;
+    line = newline ? newline + 1 : end;
+  }
+  if (profile) {
+    phase_ticks[parse_phase] += profile_clock() - profile_start;
+  }
+}
+
+void *chunk_parser_main(void *arg) {
+  chunk_reader_t *reader = arg;
+  pthread_mutex_lock(&reader->lock);
+  while (1) {
+    trace_chunk_t *chunk = &reader->chunks[reader->next_read % CHUNK_SLOTS];
+    while (!reader->eof && !reader->done && chunk->state != chunk_free) {
+      pthread_cond_wait(&reader->changed, &reader->lock);
+      chunk = &reader->chunks[reader->next_read % CHUNK_SLOTS];
+    }
+    if (reader->eof || reader->done) break;
+    read_chunk(reader, chunk);
+    reader->next_read++;
+    chunk->state = chunk_parsing;
+    pthread_mutex_unlock(&reader->lock);
+
+    parse_chunk(chunk);
+
+    pthread_mutex_lock(&reader->lock);
+    chunk->state = chunk_parsed;
+    pthread_cond_broadcast(&reader->changed);
+  }
+  pthread_mutex_unlock(&reader->lock);
+  collect_phase_ticks();
+  return NULL;
+}
+
+chunk_reader_t *start_chunk_reader(FILE *file, unsigned num_threads) {
+  chunk_reader_t *reader = sim_calloc(1, sizeof(chunk_reader_t));
+  reader->file = file;
+  reader->num_threads = num_threads;
+  reader->carry = sim_malloc(CHUNK_SIZE);
+  pthread_mutex_init(&reader->lock, NULL);
+  pthread_cond_init(&reader->changed, NULL);
+  for (int i = 0; i < CHUNK_SLOTS; ++i) {
+    reader->chunks[i].text = sim_malloc(2 * CHUNK_SIZE + 1);
+    reader->chunks[i].capacity = BATCH_SIZE;
+    reader->chunks[i].accesses = sim_malloc(BATCH_SIZE * sizeof(mem_access_t));
+  }
+  reader->threads = sim_malloc(num_threads * sizeof(pthread_t));
+  for (unsigned i = 0; i < num_threads; ++i) {
+    pthread_create(&reader->threads[i], NULL, chunk_parser_main, reader);
+  }
+  return reader;
+}
+
+// hands out the parsed chunks in file order, false once the trace has ended
+bool next_chunk(chunk_reader_t *reader, mem_access_t **batch, size_t *count) {
+  pthread_mutex_lock(&reader->lock);
+  if (reader->consuming) {
+    reader->chunks[reader->next_consume % CHUNK_SLOTS].state = chunk_free;
+    reader->next_consume++;
+    reader->consuming = false;
+    pthread_cond_broadcast(&reader->changed);
+  }
+  if (reader->done) {
+    pthread_mutex_unlock(&reader->lock);
+    return false;
+  }
+  trace_chunk_t *chunk = &reader->chunks[reader->next_consume % CHUNK_SLOTS];
+  while (chunk->state != chunk_parsed) {
+    pthread_cond_wait(&reader->changed, &reader->lock);
+  }
+  if (chunk->last) {
+    reader->done = true;
+    pthread_cond_broadcast(&reader->changed);
+  }
+  reader->consuming = true;
+  pthread_mutex_unlock(&reader->lock);
+  *batch = chunk->accesses;
+  *count = chunk->count;
+  return true;
+}
+
+void stop_chunk_reader(chunk_reader_t *reader) {
+  pthread_mutex_lock(&reader->lock);
+  reader->done = true;
+  pthread_cond_broadcast(&reader->changed);
+  pthread_mutex_unlock(&reader->lock);
+  for (unsigned i = 0; i < reader->num_threads; ++i) {
+    pthread_join(reader->threads[i], NULL);
+  }
+  for (int i = 0; i < CHUNK_SLOTS; ++i) {
+    free(reader->chunks[i].text);
+    free(reader->chunks[i].accesses);
+  }
+  pthread_mutex_destroy(&reader->lock);
+  pthread_cond_destroy(&reader->changed);
+  free(reader->threads);
+  free(reader->carry);
+  free(reader);
+}
+
+// where the simulation gets its batches from, one of the two readers
+typedef struct {
+  FILE *file;
+  // serial reading with read_batch()
+  mem_access_t *batch;
+  bool done;
+  // parallel reading, NULL unless --parse-threads is given
+  chunk_reader_t *chunks;
+} trace_reader_t;
+
+void open_trace_reader(trace_reader_t *reader, FILE *file,
+                       unsigned parse_threads) {
+  reader->file = file;
+  reader->done = false;
+  reader->batch = NULL;
+  reader->chunks = NULL;
+  if (parse_threads > 0) {
+    reader->chunks = start_chunk_reader(file, parse_threads);
+  } else {
+    reader->batch = sim_malloc(BATCH_SIZE * sizeof(mem_access_t));
+  }
+}
+
+// the batch is owned by the reader and valid until the next call
+bool next_batch(trace_reader_t *reader, mem_access_t **batch, size_t *count) {
+  if (reader->chunks) {
+    return next_chunk(reader->chunks, batch, count);
+  }
+  if (reader->done) {
+    return false;
+  }
+  *count = read_batch(reader->file, reader->batch);
+  *batch = reader->batch;
+  reader->done = *count < BATCH_SIZE;
+  return true;
+}
+
+void close_trace_reader(trace_reader_t *reader) {
+  if (reader->chunks) {
+    stop_chunk_reader(reader->chunks);
+  }
+  free(reader->batch);
+}
+
+/*
+ * Coalescing prefilter.
+ *
+ * An access to the same block with the same type as the access right before
+ * it is always a hit and changes nothing: the first one left the line in the
+ * cache array, and neither replacement policy updates on hits. Such runs are
+ * collapsed into their first access and the rest are credited as hits. With
+ * TLBs they are also L1 TLB hits on the entry that was just used.
+ */
+mem_access_t coalesce_previous = {.address = 0};
+
+// returns the number of accesses left in batch
+size_t coalesce_batch(cache_t *cache, mem_access_t *batch, size_t count) {
+  uint32_t previous_block =
+      get_block_address(cache->cache_info, coalesce_previous.address);
+  uint64_t removed[2] = {0, 0};
+  size_t kept = 0;
+  for (size_t i = 0; i < count; ++i) {
+    uint32_t block = get_block_address(cache->cache_info, batch[i].address);
+    // address 0 never reaches the simulation, so the first access is kept
+    if (coalesce_previous.address && block == previous_block &&
+        batch[i].accesstype == coalesce_previous.accesstype) {
+      removed[batch[i].accesstype]++;
+      continue;
+    }
+    coalesce_previous = batch[i];
+    previous_block = block;
+    batch[kept++] = batch[i];
+  }
+
+  uint64_t total = removed[instruction] + removed[data];
+  cache_statistics.accesses += total;
+  cache_statistics.hits += total;
+  cache_statistics.coalesced += total;
+  if (cache->mmu) {
+    cache->mmu->itlb.accesses += removed[instruction];
+    cache->mmu->itlb.hits += removed[instruction];
+    cache->mmu->dtlb.accesses += removed[data];
+    cache->mmu->dtlb.hits += removed[data];
+  }
+  return kept;
+}
+
+void simulate_batch(cache_t *cache, mem_access_t *batch, size_t count,
+                    cache_stat_t *stats) {
+  for (size_t i = 0; i < count; ++i) {
+    stats->accesses++;
+    if (cache->mmu) {
+      translate_access(cache->mmu, batch[i]);
+    }
+    if (perform_fetch(cache, batch[i])) {
+      stats->hits++;
+    }
+  }
+}
+
+/*
+ * Specialized simulation kernels.
+ *
+ * One kernel is generated for every mapping, organization and power of two
+ * cache size. It runs the same code as simulate_batch(), but flatten inlines
+ * the whole lookup and insert path with cache_info as a constant, so the
+ * branches on mapping and organization go away and all shifts and masks are
+ * immediates. The kernels only cover the plain simulation, anything with side
+ * caches, TLBs or multiple cores uses simulate_batch().
+ */
+typedef void (*batch_kernel_t)(cache_t *, mem_access_t *, size_t,
+                               cache_stat_t *);
+
+static inline cache_info_t kernel_cache_info(cache_map_t mapping,
+                                             cache_org_t org, uint32_t size) {
+  uint8_t num_blocks = ((org == sc) ? size / 2 : size) / 64;
+  uint8_t num_index_bits = (mapping == dm) ? __builtin_ctz(num_blocks) : 0;
+  return (cache_info_t){
+      .num_blocks = num_blocks,
+      .num_block_offset_bits = 6,
+      .num_index_bits = num_index_bits,
+      .num_tag_bits = 32 - 6 - num_index_bits,
+      .cache_mapping = mapping,
+      .cache_org = org,
+  };
+}
+
+#define KERNEL_SIZES(X, mapping, org)                                     \
+  X(mapping, org, 128) X(mapping, org, 256) X(mapping, org, 512)          \
+  X(mapping, org, 1024) X(mapping, org, 2048) X(mapping, org, 4096)
+#define KERNEL_CONFIGS(X)                                                 \
+  KERNEL_SIZES(X, dm, uc) KERNEL_SIZES(X, dm, sc)                         \
+  KERNEL_SIZES(X, fa, uc) KERNEL_SIZES(X, fa, sc)
+
+#define DEFINE_KERNEL(mapping, org, size)                                 \
+  __attribute__((flatten)) static void kernel_##mapping##_##org##_##size( \
+      cache_t *cache, mem_access_t *batch, size_t count,                  \
+      cache_stat_t *stats) {                                              \
+    const cache_info_t cache_info = kernel_cache_info(mapping, org, size); \
+    for (size_t i = 0; i < count; ++i) {                                  \
+      stats->accesses++;                                                  \
+      if (perform_fetch_with_info(cache, cache_info, batch[i])) {         \
+        stats->hits++;                                                    \
+      }                                                                   \
+    }                                                                     \
+  }
+KERNEL_CONFIGS(DEFINE_KERNEL)
+
+#define KERNEL_ENTRY(mapping, org, size) \
+  {mapping, org, size, kernel_##mapping##_##org##_##size},
+struct {
+  cache_map_t mapping;
+  cache_org_t org;
+  uint32_t size;
+  batch_kernel_t kernel;
+} kernels[] = {KERNEL_CONFIGS(KERNEL_ENTRY)};
+
+// used for every batch of the plain simulation, chosen once at startup
+batch_kernel_t simulate_kernel = simulate_batch;
+
+batch_kernel_t select_kernel(cache_info_t cache_info) {
+  for (size_t i = 0; i < sizeof(kernels) / sizeof(kernels[0]); ++i) {
+    cache_info_t kernel_info =
+        kernel_cache_info(kernels[i].mapping, kernels[i].org, kernels[i].size);
+    if (kernel_info.num_blocks == cache_info.num_blocks &&
+        kernel_info.cache_mapping == cache_info.cache_mapping &&
+        kernel_info.cache_org == cache_info.cache_org) {
+      return kernels[i].kernel;
+    }
+  }
+  return simulate_batch;
+}
+
+void simulate_coherent_batch(coherence_t *system, mem_access_t *batch,
+                             size_t count, cache_stat_t *stats) {
+  for (size_t i = 0; i < count; ++i) {
+    if (batch[i].core >= system->num_cores) {
+      printf("Core id %d out of range\n", batch[i].core);
+      exit(0);
+    }
+    cache_stat_t *core_stats = &system->core_stats[batch[i].core];
+    stats->accesses++;
+    core_stats->accesses++;
+    mmu_t *mmu = system->cores[batch[i].core].mmu;
+    if (mmu) {
+      translate_access(mmu, batch[i]);
+    }
+    if (perform_coherent_fetch(system, batch[i])) {
+      stats->hits++;
+      core_stats->hits++;
+    }
+  }
+}
+
+/*
+ * Parallel simulation by set index.
+ *
+ * In a dm cache every access only ever touches the line at its own index, in
+ * both the data and the instruction cache (the I/D invalidation in
+ * perform_lookup() looks up the same address, so the same index). Sets are
+ * therefore independent and each worker can own the indices where
+ * index % num_workers == worker id. Every batch is split by owner, keeping
+ * trace order within each worker, which gives the exact serial result.
+ *
+ * The same holds with multiple cores, snooping only looks at the same index in
+ * the other caches. Every worker then keeps its own line records and
+ * coherence statistics, the line records of different workers never overlap.
+ *
+ * The slices are double buffered: while the workers simulate one batch, the
+ * main thread reads and splits the next one into the other buffer.
+ */
+typedef struct {
+  pthread_t thread;
+  cache_t *cache;
+  // this worker's slices of the batch being simulated and of the next one
+  mem_access_t *accesses[2];
+  size_t count[2];
+  cache_stat_t stats;
+  // NULL unless simulating multiple cores
+  coherence_t *coherence;
+} set_worker_t;
+
+// adds the statistics and line records of a worker to system
+void merge_coherence(coherence_t *system, coherence_t *worker) {
+  uint64_t *total = (uint64_t *)&system->stats;
+  uint64_t *part = (uint64_t *)&worker->stats;
+  for (size_t i = 0; i < sizeof(coherence_stat_t) / sizeof(uint64_t); ++i) {
+    total[i] += part[i];
+  }
+  for (unsigned core = 0; core < system->num_cores; ++core) {
+    system->core_stats[core].accesses += worker->core_stats[core].accesses;
+    system->core_stats[core].hits += worker->core_stats[core].hits;
+  }
+  for (size_t i = 0; i < worker->lines.capacity; ++i) {
+    line_record_t *record = &worker->lines.records[i];
+    if (record->key) {
+      *get_line_record(&system->lines, record->key & ~0x80000000) = *record;
+    }
+  }
+}
+
+pthread_barrier_t batch_ready;
+pthread_barrier_t batch_done;
+bool trace_done;
+// buffer of the slices the workers simulate, set before batch_ready
+unsigned batch_buffer;
+
+void *set_worker_main(void *arg) {
+  set_worker_t *worker = arg;
+  while (1) {
+    pthread_barrier_wait(&batch_ready);
+    if (trace_done) break;
+    mem_access_t *accesses = worker->accesses[batch_buffer];
+    size_t count = worker->count[batch_buffer];
+    if (worker->coherence) {
+      simulate_coherent_batch(worker->coherence, accesses, count,
+                              &worker->stats);
+    } else {
+      simulate_kernel(worker->cache, accesses, count, &worker->stats);
+    }
+    pthread_barrier_wait(&batch_done);
+  }
+  collect_phase_ticks();
+  return NULL;
+}
+
+// reads the next batch and splits it into buffer of the workers, returns
+// false once the trace is done
+bool split_next_batch(cache_t *cache, trace_reader_t *reader,
+                      set_worker_t *workers, unsigned num_workers,
+                      unsigned buffer, size_t *capacity) {
+  mem_access_t *batch;
+  size_t count;
+  if (!next_batch(reader, &batch, &count)) {
+    return false;
+  }
+  size_t kept = coalesce ? coalesce_batch(cache, batch, count) : count;
+  // parsed chunks can be larger than a batch
+  if (kept > capacity[buffer]) {
+    capacity[buffer] = kept;
+    for (unsigned i = 0; i < num_workers; ++i) {
+      workers[i].accesses[buffer] = sim_realloc(
+          workers[i].accesses[buffer], kept * sizeof(mem_access_t));
+    }
+  }
+  for (unsigned i = 0; i < num_workers; ++i) {
+    workers[i].count[buffer] = 0;
+  }
+  for (size_t i = 0; i < kept; ++i) {
+    set_worker_t *owner =
+        &workers[get_dm_index(cache->cache_info, batch[i].address) %
+                 num_workers];
+    owner->accesses[buffer][owner->count[buffer]++] = batch[i];
+  }
+  return true;
+}
+
+void simulate_trace_parallel(cache_t *cache, trace_reader_t *reader,
+                             unsigned num_workers, coherence_t *system) {
+  set_worker_t *workers = sim_calloc(num_workers, sizeof(set_worker_t));
+  size_t capacity[2] = {BATCH_SIZE, BATCH_SIZE};
+  pthread_barrier_init(&batch_ready, NULL, num_workers + 1);
+  pthread_barrier_init(&batch_done, NULL, num_workers + 1);
+  trace_done = false;
+  for (unsigned i = 0; i < num_workers; ++i) {
+    workers[i].cache = cache;
+    workers[i].accesses[0] = sim_malloc(BATCH_SIZE * sizeof(mem_access_t));
+    workers[i].accesses[1] = sim_malloc(BATCH_SIZE * sizeof(mem_access_t));
+    if (system) {
+      workers[i].coherence = sim_calloc(1, sizeof(coherence_t));
+      workers[i].coherence->cores = system->cores;
+      workers[i].coherence->num_cores = system->num_cores;
+      init_line_table(&workers[i].coherence->lines);
+    }
+    pthread_create(&workers[i].thread, NULL, set_worker_main, &workers[i]);
+  }
+
+  unsigned buffer = 0;
+  bool more = split_next_batch(cache, reader, workers, num_workers, buffer,
+                               capacity);
+  while (more) {
+    batch_buffer = buffer;
+    pthread_barrier_wait(&batch_ready);
+    buffer ^= 1;
+    more = split_next_batch(cache, reader, workers, num_workers, buffer,
+                            capacity);
+    pthread_barrier_wait(&batch_done);
+  }
+  collect_phase_ticks();
+
+  trace_done = true;
+  pthread_barrier_wait(&batch_ready);
+  for (unsigned i = 0; i < num_workers; ++i) {
+    pthread_join(workers[i].thread, NULL);
+    cache_statistics.accesses += workers[i].stats.accesses;
+    cache_statistics.hits += workers[i].stats.hits;
+    free(workers[i].accesses[0]);
+    free(workers[i].accesses[1]);
+    if (system) {
+      merge_coherence(system, workers[i].coherence);
+      free(workers[i].coherence->lines.records);
+      free(workers[i].coherence);
+    }
+  }
+  pthread_barrier_destroy(&batch_ready);
+  pthread_barrier_destroy(&batch_done);
+  free(workers);
+}
+
+void simulate_trace(cache_t *cache, trace_reader_t *reader,
+                    coherence_t *system) {
+  mem_access_t *batch;
+  size_t count;
+  while (next_batch(reader, &batch, &count)) {
+    if (system) {
+      simulate_coherent_batch(system, batch, count, &cache_statistics);
+    } else {
+      size_t kept = coalesce ? coalesce_batch(cache, batch, count) : count;
+      simulate_kernel(cache, batch, kept, &cache_statistics);
+    }
+  }
+  collect_phase_ticks();
+}
+
+void init_cache(cache_t *cache, cache_info_t cache_info) {
+  cache->cache_info = cache_info;
+  cache_data_t *caches[] = {&cache->data_cache, &cache->instruction_cache};
+  for (int i = 0; i < 2; ++i) {
+    *caches[i] = (cache_data_t){
+        .data = sim_calloc(cache_info.num_blocks, sizeof(uint32_t)),
+        .queue = NULL,
+        .side = {.data = sim_calloc(side_cache_entries, sizeof(uint32_t)),
+                 .num_entries = side_cache_entries},
+    };
+  }
+  cache->mmu = NULL;
+  if (tlb_enabled) {
+    cache->mmu = sim_calloc(1, sizeof(mmu_t));
+    init_tlb(&cache->mmu->itlb, l1_tlb_entries, l1_tlb_ways);
+    init_tlb(&cache->mmu->dtlb, l1_tlb_entries, l1_tlb_ways);
+    init_tlb(&cache->mmu->l2_tlb, l2_tlb_entries, l2_tlb_ways);
+  }
+}
+
+void free_cache(cache_t *cache) {
+  cache_data_t *caches[] = {&cache->data_cache, &cache->instruction_cache};
+  for (int i = 0; i < 2; ++i) {
+    free(caches[i]->data);
+    free(caches[i]->side.data);
+    fifo_node_t *counter = caches[i]->queue;
+    while (counter) {
+      fifo_node_t *temp = counter;
+      counter = counter->next;
+      free(temp);
+    }
+  }
+  if (cache->mmu) {
+    tlb_t *tlbs[] = {&cache->mmu->itlb, &cache->mmu->dtlb, &cache->mmu->l2_tlb};
+    for (int i = 0; i < 3; ++i) {
+      free(tlbs[i]->entries);
+      free(tlbs[i]->last_used);
+    }
+    free(cache->mmu);
+  }
+}
+
+// initializes cache, and returns the caches of all cores with more than one
+// core (cache is not used then), NULL otherwise
+coherence_t *init_simulation(cache_t *cache, cache_info_t cache_info) {
+  init_cache(cache, cache_info);
+  if (num_cores <= 1) {
+    return NULL;
+  }
+  coherence_t *system = sim_calloc(1, sizeof(coherence_t));
+  system->num_cores = num_cores;
+  system->cores = sim_calloc(num_cores, sizeof(cache_t));
+  for (unsigned core = 0; core < num_cores; ++core) {
+    init_cache(&system->cores[core], cache_info);
+  }
+  init_line_table(&system->lines);
+  return system;
+}
+
+void free_simulation(cache_t *cache, coherence_t *system) {
+  free_cache(cache);
+  if (system) {
+    for (unsigned core = 0; core < system->num_cores; ++core) {
+      free_cache(&system->cores[core]);
+    }
+    free(system->cores);
+    free(system->lines.records);
+    free(system);
+  }
+}
+
+/*
+ * Server mode.
+ *
+ * With --server NAME the simulator keeps its caches resident and serves
+ * batches of accesses from other processes through the POSIX shared memory
+ * object /NAME, so a query pays no process start, allocation or warm-up.
+ * --client NAME replays mem_trace.txt through a running server.
+ *
+ * The object holds SERVER_CHANNELS channels. A client claims a free channel
+ * by writing its pid to it and owns it until it lets it go, a channel owned
+ * by a process that no longer exists is free again. Every channel has its own
+ * caches and statistics on the server, so concurrent clients never see each
+ * other's accesses. Every channel is a single producer single consumer ring
+ * of RING_SLOTS slots: the client fills in the request of slot
+ * submitted % RING_SLOTS and increments submitted, the server simulates it,
+ * fills in the response of the same slot and increments completed. Both
+ * counters only grow and sit on cache lines of their own. No side makes a
+ * system call while requests keep coming, only an idle server sleeps.
+ *
+ * The server bumps heartbeat on every poll of the channels. A waiting client
+ * gives up when the server process is gone, has cleared magic on its way out
+ * or has not bumped heartbeat for SERVER_TIMEOUT seconds.
+ */
+#define SERVER_MAGIC 0x43534d32
+#define SERVER_CHANNELS 4
+#define RING_SLOTS 8
+#define SLOT_ACCESSES 4096
+// polls before an idle server or a waiting client starts sleeping between
+// polls
+#define SERVER_SPINS (1 << 16)
+#define SERVER_TIMEOUT 5
+
+// access as written by clients, independent of the enum sizes of mem_access_t
+typedef struct {
+  uint32_t address;
+  uint8_t accesstype; // 0 instruction, 1 data
+  uint8_t core;
+  uint8_t write;
+  uint8_t reserved;
+} wire_access_t;
+
+typedef enum { slot_ok, slot_bad_count, slot_bad_core } slot_status_t;
+
+typedef struct {
+  // request
+  uint32_t count;
+  // clear the caches and statistics before simulating this batch
+  uint32_t reset;
+  wire_access_t accesses[SLOT_ACCESSES];
+  // response
+  uint32_t status;
+  // bit i % 64 of hit_bits[i / 64] is set if access i hit
+  uint64_t hit_bits[SLOT_ACCESSES / 64];
+  // statistics of all accesses since the last reset, this batch included
+  cache_stat_t stats;
+} ring_slot_t;
+
+typedef struct {
+  // pid of the client owning the channel, 0 if free
+  _Alignas(64) pid_t in_use;
+  _Alignas(64) uint64_t submitted;
+  _Alignas(64) uint64_t completed;
+  ring_slot_t slots[RING_SLOTS];
+} channel_t;
+
+// everything the simulated hits depend on, a client only replays through a
+// server with the same configuration. Settings of disabled features are 0.
+typedef struct {
+  uint32_t cache_size;
+  uint32_t block_size;
+  uint32_t cache_mapping;
+  uint32_t cache_org;
+  uint32_t side_cache;
+  uint32_t side_cache_entries;
+  uint32_t num_cores;
+  uint32_t coherence_protocol;
+  uint32_t tlb_enabled;
+  uint32_t l1_tlb_entries;
+  uint32_t l1_tlb_ways;
+  uint32_t l2_tlb_entries;
+  uint32_t l2_tlb_ways;
+  uint32_t page_offset_bits;
+  uint32_t l2_tlb_cycles;
+  uint32_t walk_cycles;
+} server_config_t;
+
+typedef struct {
+  uint32_t magic;
+  pid_t server_pid;
+  server_config_t config;
+  _Alignas(64) uint64_t heartbeat;
+  channel_t channels[SERVER_CHANNELS];
+} server_shm_t;
+
+// the configuration given on the command line
+server_config_t current_config(void) {
+  server_config_t config = {.cache_size = cache_size,
+                            .block_size = block_size,
+                            .cache_mapping = cache_mapping,
+                            .cache_org = cache_org,
+                            .side_cache = side_cache,
+                            .num_cores = num_cores,
+                            .tlb_enabled = tlb_enabled};
+  if (side_cache != no_side_cache) {
+    config.side_cache_entries = side_cache_entries;
+  }
+  if (num_cores > 1) {
+    config.coherence_protocol = coherence_protocol;
+  }
+  if (tlb_enabled) {
+    config.l1_tlb_entries = l1_tlb_entries;
+    config.l1_tlb_ways = l1_tlb_ways;
+    config.l2_tlb_entries = l2_tlb_entries;
+    config.l2_tlb_ways = l2_tlb_ways;
+    config.page_offset_bits = page_offset_bits;
+    config.l2_tlb_cycles = l2_tlb_cycles;
+    config.walk_cycles = walk_cycles;
+  }
+  return config;
+}
+
+// whether a process exists, if we may signal it or not
+bool process_alive(pid_t pid) {
+  return pid > 0 && (kill(pid, 0) == 0 || errno == EPERM);
+}
+
+volatile sig_atomic_t server_stop = 0;
+
+void stop_server(int signal) {
+  (void)signal;
+  server_stop = 1;
+}
+
+// hits served by the victim or miss caches of cache
+uint64_t side_cache_hits(cache_t *cache) {
+  return cache->data_cache.side.hits + cache->instruction_cache.side.hits;
+}
+
+// the resident simulation of a channel
+typedef struct {
+  cache_t cache;
+  // NULL unless simulating multiple cores
+  coherence_t *system;
+  cache_stat_t stats;
+} channel_model_t;
+
+void reset_simulation(cache_t *cache, coherence_t *system) {
+  cache_info_t cache_info = cache->cache_info;
+  free_cache(cache);
+  init_cache(cache, cache_info);
+  if (system) {
+    for (unsigned core = 0; core < system->num_cores; ++core) {
+      free_cache(&system->cores[core]);
+      init_cache(&system->cores[core], cache_info);
+    }
+    free(system->lines.records);
+    init_line_table(&system->lines);
+    memset(&system->stats, 0, sizeof(system->stats));
+    memset(system->core_stats, 0, sizeof(system->core_stats));
+  }
+}
+
+void serve_slot(ring_slot_t *slot, channel_model_t *model,
+                mem_access_t *batch) {
+  cache_t *cache = &model->cache;
+  coherence_t *system = model->system;
+  uint32_t count = slot->count;
+  unsigned num_cores = system ? system->num_cores : 1;
+  slot->status = slot_ok;
+  if (count > SLOT_ACCESSES) {
+    slot->status = slot_bad_count;
+    count = 0;
+  }
+  for (uint32_t i = 0; i < count; ++i) {
+    wire_access_t access = slot->accesses[i];
+    if (system && access.core >= num_cores) {
+      slot->status = slot_bad_core;
+      count = 0;
+      break;
+    }
+    batch[i] = (mem_access_t){.address = access.address,
+                              .accesstype = access.accesstype ? data : instruction,
+                              .core = access.core,
+                              .write = access.write};
+  }
+  if (slot->reset) {
+    reset_simulation(cache, system);
+    memset(&model->stats, 0, sizeof(model->stats));
+  }
+
+  memset(slot->hit_bits, 0, (count + 63) / 64 * sizeof(uint64_t));
+  for (uint32_t i = 0; i < count; ++i) {
+    bool hit;
+    model->stats.accesses++;
+    if (system) {
+      cache_stat_t *core_stats = &system->core_stats[batch[i].core];
+      core_stats->accesses++;
+      mmu_t *mmu = system->cores[batch[i].core].mmu;
+      if (mmu) {
+        translate_access(mmu, batch[i]);
+      }
+      hit = perform_coherent_fetch(system, batch[i]);
+      core_stats->hits += hit;
+    } else {
+      if (cache->mmu) {
+        translate_access(cache->mmu, batch[i]);
+      }
+      hit = perform_fetch(cache, batch[i]);
+    }
+    model->stats.hits += hit;
+    slot->hit_bits[i / 64] |= (uint64_t)hit << (i % 64);
+  }
+  slot->stats = model->stats;
+  slot->stats.side_hits = side_cache_hits(cache);
+}
+
+server_shm_t *map_server_shm(const char *name, bool create) {
+  char path[256];
+  snprintf(path, sizeof(path), "/%s", name);
+  int fd = shm_open(path, create ? O_RDWR | O_CREAT | O_EXCL : O_RDWR, 0600);
+  if (fd < 0) {
+    printf("Unable to open shared memory %s\n", path);
+    return NULL;
+  }
+  if (create && ftruncate(fd, sizeof(server_shm_t)) != 0) {
+    printf("Unable to size shared memory %s\n", path);
+    close(fd);
+    shm_unlink(path);
+    return NULL;
+  }
+  struct stat st;
+  if (!create && (fstat(fd, &st) != 0 || st.st_size != sizeof(server_shm_t))) {
+    printf("Shared memory %s is not a server of this version\n", path);
+    close(fd);
+    return NULL;
+  }
+  server_shm_t *shm = mmap(NULL, sizeof(server_shm_t), PROT_READ | PROT_WRITE,
+                           MAP_SHARED, fd, 0);
+  close(fd);
+  if (shm == MAP_FAILED) {
+    printf("Unable to map shared memory %s\n", path);
+    if (create) {
+      shm_unlink(path);
+    }
+    return NULL;
+  }
+  return shm;
+}
+
+// removes the shared memory left behind by a server that was killed, so a
+// new server can take over its name
+void remove_dead_server(const char *name) {
+  char path[256];
+  snprintf(path, sizeof(path), "/%s", name);
+  int fd = shm_open(path, O_RDONLY, 0);
+  if (fd < 0) {
+    return;
+  }
+  struct stat st;
+  server_shm_t *shm = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && st.st_size == sizeof(server_shm_t)) {
+    shm = mmap(NULL, sizeof(server_shm_t), PROT_READ, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  if (shm == MAP_FAILED) {
+    return;
+  }
+  pid_t pid = __atomic_load_n(&shm->server_pid, __ATOMIC_ACQUIRE);
+  if (pid > 0 && !process_alive(pid)) {
+    printf("Removing %s of server %d, which is gone\n", path, (int)pid);
+    shm_unlink(path);
+  }
+  munmap(shm, sizeof(server_shm_t));
+}
+
+void run_server(const char *name, cache_info_t cache_info) {
+  remove_dead_server(name);
+  server_shm_t *shm = map_server_shm(name, true);
+  if (!shm) {
+    exit(1);
+  }
+  channel_model_t *models =
+      sim_calloc(SERVER_CHANNELS, sizeof(channel_model_t));
+  for (unsigned c = 0; c < SERVER_CHANNELS; ++c) {
+    models[c].system = init_simulation(&models[c].cache, cache_info);
+  }
+  shm->config = current_config();
+  __atomic_store_n(&shm->server_pid, getpid(), __ATOMIC_RELEASE);
+  __atomic_store_n(&shm->magic, SERVER_MAGIC, __ATOMIC_RELEASE);
+
+  struct sigaction action = {.sa_handler = stop_server};
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+  printf("Serving on /%s, stop with SIGINT or SIGTERM\n", name);
+  fflush(stdout);
+
+  mem_access_t *batch = sim_malloc(SLOT_ACCESSES * sizeof(mem_access_t));
+  uint64_t served = 0;
+  unsigned idle = 0;
+  while (!server_stop) {
+    bool worked = false;
+    __atomic_store_n(&shm->heartbeat, shm->heartbeat + 1, __ATOMIC_RELAXED);
+    for (unsigned c = 0; c < SERVER_CHANNELS; ++c) {
+      channel_t *channel = &shm->channels[c];
+      uint64_t next = channel->completed;
+      if (next == __atomic_load_n(&channel->submitted, __ATOMIC_ACQUIRE)) {
+        continue;
+      }
+      serve_slot(&channel->slots[next % RING_SLOTS], &models[c], batch);
+      __atomic_store_n(&channel->completed, next + 1, __ATOMIC_RELEASE);
+      served++;
+      worked = true;
+    }
+    if (worked) {
+      idle = 0;
+    } else if (++idle < SERVER_SPINS) {
+#if defined(__x86_64__) || defined(__i386__)
+      _mm_pause();
+#endif
+    } else {
+      nanosleep(&(struct timespec){.tv_nsec = 100000}, NULL);
+    }
+  }
+
+  printf("Served %" PRIu64 " batches\n", served);
+  free(batch);
+  for (unsigned c = 0; c < SERVER_CHANNELS; ++c) {
+    free_simulation(&models[c].cache, models[c].system);
+  }
+  free(models);
+  // clients still waiting on a request give up
+  __atomic_store_n(&shm->magic, 0, __ATOMIC_RELEASE);
+  munmap(shm, sizeof(server_shm_t));
+  char path[256];
+  snprintf(path, sizeof(path), "/%s", name);
+  shm_unlink(path);
+}
+
+// waits until request number slot is answered, exits if the server dies or
+// stops polling before that
+void wait_completed(server_shm_t *shm, channel_t *channel, uint64_t slot) {
+  uint64_t heartbeat = __atomic_load_n(&shm->heartbeat, __ATOMIC_RELAXED);
+  struct timespec beat_time;
+  clock_gettime(CLOCK_MONOTONIC, &beat_time);
+  unsigned spins = 0;
+  while (__atomic_load_n(&channel->completed, __ATOMIC_ACQUIRE) <= slot) {
+    if (++spins < SERVER_SPINS) {
+#if defined(__x86_64__) || defined(__i386__)
+      _mm_pause();
+#endif
+      continue;
+    }
+    // a slow answer, check on the server between naps from now on
+    nanosleep(&(struct timespec){.tv_nsec = 100000}, NULL);
+    if (__atomic_load_n(&shm->magic, __ATOMIC_ACQUIRE) != SERVER_MAGIC ||
+        !process_alive(shm->server_pid)) {
+      printf("The server stopped before answering\n");
+      exit(1);
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    uint64_t beat = __atomic_load_n(&shm->heartbeat, __ATOMIC_RELAXED);
+    if (beat != heartbeat) {
+      heartbeat = beat;
+      beat_time = now;
+    } else if (now.tv_sec - beat_time.tv_sec > SERVER_TIMEOUT) {
+      printf("The server has not responded for %d seconds\n", SERVER_TIMEOUT);
+      exit(1);
+    }
+  }
+}
+
+// waits for the response to request number slot and adds it to stats
+void consume_response(server_shm_t *shm, channel_t *channel, uint64_t slot,
+                      cache_stat_t *stats) {
+  ring_slot_t *done = &channel->slots[slot % RING_SLOTS];
+  wait_completed(shm, channel, slot);
+  if (done->status != slot_ok) {
+    printf("The server rejected a batch (status %u)\n", done->status);
+    exit(1);
+  }
+  stats->accesses += done->count;
+  for (uint32_t w = 0; w < (done->count + 63) / 64; ++w) {
+    stats->hits += __builtin_popcountll(done->hit_bits[w]);
+  }
+  stats->side_hits = done->stats.side_hits;
+}
+
+// replays the trace through the server. The caches are reset first, so with
+// no other client on the server the result is the one of a standalone run.
+cache_stat_t run_client(const char *name, trace_reader_t *reader) {
+  server_shm_t *shm = map_server_shm(name, false);
+  if (!shm || __atomic_load_n(&shm->magic, __ATOMIC_ACQUIRE) != SERVER_MAGIC ||
+      !process_alive(shm->server_pid)) {
+    printf("No server on /%s\n", name);
+    exit(1);
+  }
+  server_config_t config = current_config();
+  if (memcmp(&shm->config, &config, sizeof(config)) != 0) {
+    printf("The server simulates a different configuration\n");
+    exit(1);
+  }
+  channel_t *channel = NULL;
+  pid_t self = getpid();
+  for (unsigned c = 0; c < SERVER_CHANNELS && !channel; ++c) {
+    pid_t owner = 0;
+    if (__atomic_compare_exchange_n(&shm->channels[c].in_use, &owner, self,
+                                    false, __ATOMIC_ACQUIRE,
+                                    __ATOMIC_RELAXED) ||
+        // taken over from a client that died holding it
+        (!process_alive(owner) &&
+         __atomic_compare_exchange_n(&shm->channels[c].in_use, &owner, self,
+                                     false, __ATOMIC_ACQUIRE,
+                                     __ATOMIC_RELAXED))) {
+      channel = &shm->channels[c];
+    }
+  }
+  if (!channel) {
+    printf("All %d server channels are in use\n", SERVER_CHANNELS);
+    exit(1);
+  }
+
+  // requests left behind by a previous client are still answered
+  uint64_t submitted = channel->submitted;
+  uint64_t consumed = submitted;
+  if (submitted) {
+    wait_completed(shm, channel, submitted - 1);
+  }
+  cache_stat_t stats = {0};
+  bool reset = true;
+  mem_access_t *batch;
+  size_t count;
+  while (next_batch(reader, &batch, &count)) {
+    for (size_t start = 0; start < count; start += SLOT_ACCESSES) {
+      if (submitted - consumed == RING_SLOTS) {
+        consume_response(shm, channel, consumed++, &stats);
+      }
+      ring_slot_t *slot = &channel->slots[submitted % RING_SLOTS];
+      slot->count = count - start < SLOT_ACCESSES ? count - start : SLOT_ACCESSES;
+      slot->reset = reset;
+      reset = false;
+      for (uint32_t i = 0; i < slot->count; ++i) {
+        mem_access_t access = batch[start + i];
+        slot->accesses[i] = (wire_access_t){.address = access.address,
+                                            .accesstype = access.accesstype == data,
+                                            .core = access.core,
+                                            .write = access.write};
+      }
+      __atomic_store_n(&channel->submitted, ++submitted, __ATOMIC_RELEASE);
+    }
+  }
+  while (consumed < submitted) {
+    consume_response(shm, channel, consumed++, &stats);
+  }
+  __atomic_store_n(&channel->in_use, 0, __ATOMIC_RELEASE);
+  munmap(shm, sizeof(server_shm_t));
+  return stats;
+}
+
+// parses a TLB geometry given as entries:ways
+void parse_tlb_geometry(char *arg, uint16_t *entries, uint8_t *ways) {
+  char *sep = strchr(arg, ':');
+  *entries = atoi(arg);
+  *ways = sep ? atoi(sep + 1) : 1;
+  if (*entries == 0) {
+    // no TLB at this level
+    *ways = 0;
+    return;
+  }
+  if (*ways == 0 || *entries % *ways != 0 ||
+      ((*entries / *ways) & (*entries / *ways - 1)) != 0) {
+    printf("TLB entries must be a power of two multiple of the ways\n");
+    exit(0);
+  }
+}
+
+double miss_rate(tlb_t *tlb) {
+  return tlb->accesses ? 1.0 - (double)tlb->hits / tlb->accesses : 0.0;
+}
+
+void print_tlb_statistics(cache_t *caches, unsigned count) {
+  // all cores have the same TLBs, report them together
+  mmu_t total = {0};
+  for (unsigned i = 0; i < count; ++i) {
+    mmu_t *mmu = caches[i].mmu;
+    tlb_t *from[] = {&mmu->itlb, &mmu->dtlb, &mmu->l2_tlb};
+    tlb_t *to[] = {&total.itlb, &total.dtlb, &total.l2_tlb};
+    for (int j = 0; j < 3; ++j) {
+      to[j]->accesses += from[j]->accesses;
+      to[j]->hits += from[j]->hits;
+    }
+    total.walks += mmu->walks;
+    total.cycles += mmu->cycles;
+  }
+  uint64_t accesses = total.itlb.accesses + total.dtlb.accesses;
+
+  printf("\nTLB Statistics (%s pages)\n",
+         (page_offset_bits == 12) ? "4K" : (page_offset_bits == 21) ? "2M" : "1G");
+  printf("-----------------\n\n");
+  printf("L1 iTLB miss rate: %.4f (%d entries, %d way)\n", miss_rate(&total.itlb),
+         l1_tlb_entries, l1_tlb_ways);
+  printf("L1 dTLB miss rate: %.4f (%d entries, %d way)\n", miss_rate(&total.dtlb),
+         l1_tlb_entries, l1_tlb_ways);
+  if (l2_tlb_ways) {
+    printf("L2 TLB miss rate:  %.4f (%d entries, %d way)\n",
+           miss_rate(&total.l2_tlb), l2_tlb_entries, l2_tlb_ways);
+  }
+  printf("Page walks:        %ld\n", total.walks);
+  printf("Translation cycles per access: %.2f\n",
+         accesses ? (double)total.cycles / accesses : 0.0);
+}
+
+void print_profile(double seconds) {
+  static const char *names[] = {"Parse", "Lookup", "Insert"};
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+
+  printf("\nProfile (%s)\n", PROFILE_UNIT);
+  printf("-----------------\n\n");
+  for (int i = 0; i < num_phases; ++i) {
+    printf("%-7s %14lu (%.1f per access)\n", names[i], total_phase_ticks[i],
+           (double)total_phase_ticks[i] / cache_statistics.accesses);
+  }
+  printf("Time:   %.3f s, %.0f accesses/s\n", seconds,
+         cache_statistics.accesses / seconds);
+  printf("Peak RSS: %ld KB\n", usage.ru_maxrss);
+  printf("Mallocs:  %lu\n", malloc_count);
+}
+
+// sorts line records by false sharing misses, then coherence misses
+int compare_line_records(const void *a, const void *b) {
+  const line_record_t *x = a, *y = b;
+  if (x->false_sharing_misses != y->false_sharing_misses) {
+    return (x->false_sharing_misses < y->false_sharing_misses) ? 1 : -1;
+  }
+  if (x->coherence_misses != y->coherence_misses) {
+    return (x->coherence_misses < y->coherence_misses) ? 1 : -1;
+  }
+  return 0;
+}
+
+void print_coherence_statistics(coherence_t *system) {
+  coherence_stat_t *stats = &system->stats;
+  uint64_t dirty_evictions = 0;
+  for (unsigned core = 0; core < system->num_cores; ++core) {
+    dirty_evictions += system->cores[core].data_cache.dirty_evictions +
+                       system->cores[core].instruction_cache.dirty_evictions;
+  }
+
+  printf("\nCoherence Statistics (%s, %u cores)\n",
+         (coherence_protocol == moesi) ? "MOESI" : "MESI", system->num_cores);
+  printf("-----------------\n\n");
+  for (unsigned core = 0; core < system->num_cores; ++core) {
+    cache_stat_t *core_stats = &system->core_stats[core];
+    printf("Core %2u:  %ld accesses, hit rate %.4f\n", core,
+           core_stats->accesses,
+           core_stats->accesses
+               ? (double)core_stats->hits / core_stats->accesses
+               : 0.0);
+  }
+  printf("Bus reads:            %ld\n", stats->bus_reads);
+  printf("Bus read exclusives:  %ld\n", stats->bus_read_exclusives);
+  printf("Bus upgrades:         %ld\n", stats->bus_upgrades);
+  printf("Invalidations:        %ld\n", stats->invalidations);
+  printf("Cache transfers:      %ld\n", stats->cache_transfers);
+  printf("Writebacks:           %ld\n", stats->flushes + dirty_evictions);
+  printf("Coherence misses:     %ld\n", stats->coherence_misses);
+  printf("False sharing misses: %ld\n", stats->false_sharing_misses);
+
+  // worst lines, only those that actually saw coherence misses
+  line_record_t *sorted = sim_malloc(system->lines.used * sizeof(line_record_t));
+  size_t count = 0;
+  for (size_t i = 0; i < system->lines.capacity; ++i) {
+    if (system->lines.records[i].coherence_misses) {
+      sorted[count++] = system->lines.records[i];
+    }
+  }
+  qsort(sorted, count, sizeof(line_record_t), compare_line_records);
+  if (count) {
+    printf("\nLine        Invalidations  Coherence misses  False sharing\n");
+  }
+  for (size_t i = 0; i < count && i < 10; ++i) {
+    printf("0x%08x  %13ld  %16ld  %13ld\n",
+           (sorted[i].key & ~0x80000000) << 6, sorted[i].invalidations,
+           sorted[i].coherence_misses, sorted[i].false_sharing_misses);
+  }
+  free(sorted);
 }
 
 void main(int argc, char **argv) {
@@ -319,11 +2129,15 @@ void main(int argc, char **argv) {
    * CAN RUN THE RESULTING BINARY WITHOUT HAVING TO SUPPLY MORE PARAMETERS THAN
    * SPECIFIED IN THE UNMODIFIED FILE (cache_size, cache_mapping and cache_org)
    */
-  if (argc != 4) { /* argc should be 2 for correct execution */
+  if (argc < 4) { /* argc should be 2 for correct execution */
     printf(
         "Usage: ./cache_sim [data_cache size: 128-4096] [data_cache mapping: "
         "dm|fa] "
-        "[data_cache organization: uc|sc]\n");
+        "[data_cache organization: uc|sc] [--threads N] [--victim N|--miss-cache N] "
+        "[--cores N] [--protocol mesi|moesi] [--tlb] [--l1-tlb entries:ways] "
+        "[--l2-tlb entries:ways] [--page-size 4k|2m|1g] [--walk-cycles N] "
+        "[--generic] [--coalesce] [--profile] [--parse-threads N] "
+        "[--server NAME|--client NAME]\n");
     exit(0);
   } else {
     /* argv[0] is program name, parameters start with argv[1] */
@@ -350,6 +2164,77 @@ void main(int argc, char **argv) {
       printf("Unknown data_cache organization\n");
       exit(0);
     }
+
+    /* Optional parameters, all default to the plain serial simulator */
+    for (int i = 4; i < argc; ++i) {
+      if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+        num_threads = atoi(argv[++i]);
+      } else if (strcmp(argv[i], "--victim") == 0 && i + 1 < argc) {
+        side_cache = victim_cache;
+        side_cache_entries = atoi(argv[++i]);
+      } else if (strcmp(argv[i], "--miss-cache") == 0 && i + 1 < argc) {
+        side_cache = miss_cache;
+        side_cache_entries = atoi(argv[++i]);
+      } else if (strcmp(argv[i], "--cores") == 0 && i + 1 < argc) {
+        num_cores = atoi(argv[++i]);
+        if (num_cores < 1 || num_cores > MAX_CORES) {
+          printf("Number of cores must be 1-%d\n", MAX_CORES);
+          exit(0);
+        }
+      } else if (strcmp(argv[i], "--parse-threads") == 0 && i + 1 < argc) {
+        parse_threads = atoi(argv[++i]);
+      } else if (strcmp(argv[i], "--server") == 0 && i + 1 < argc) {
+        server_name = argv[++i];
+      } else if (strcmp(argv[i], "--client") == 0 && i + 1 < argc) {
+        client_name = argv[++i];
+      } else if (strcmp(argv[i], "--profile") == 0) {
+        profile = true;
+      } else if (strcmp(argv[i], "--coalesce") == 0) {
+        coalesce = true;
+      } else if (strcmp(argv[i], "--generic") == 0) {
+        use_kernels = false;
+      } else if (strcmp(argv[i], "--tlb") == 0) {
+        tlb_enabled = true;
+      } else if (strcmp(argv[i], "--l1-tlb") == 0 && i + 1 < argc) {
+        tlb_enabled = true;
+        parse_tlb_geometry(argv[++i], &l1_tlb_entries, &l1_tlb_ways);
+        if (l1_tlb_entries == 0) {
+          printf("The L1 TLB needs at least one entry\n");
+          exit(0);
+        }
+      } else if (strcmp(argv[i], "--l2-tlb") == 0 && i + 1 < argc) {
+        tlb_enabled = true;
+        parse_tlb_geometry(argv[++i], &l2_tlb_entries, &l2_tlb_ways);
+      } else if (strcmp(argv[i], "--page-size") == 0 && i + 1 < argc) {
+        tlb_enabled = true;
+        i++;
+        if (strcmp(argv[i], "4k") == 0) {
+          page_offset_bits = 12;
+        } else if (strcmp(argv[i], "2m") == 0) {
+          page_offset_bits = 21;
+        } else if (strcmp(argv[i], "1g") == 0) {
+          page_offset_bits = 30;
+        } else {
+          printf("Unknown page size\n");
+          exit(0);
+        }
+      } else if (strcmp(argv[i], "--walk-cycles") == 0 && i + 1 < argc) {
+        tlb_enabled = true;
+        walk_cycles = atoi(argv[++i]);
+      } else if (strcmp(argv[i], "--protocol") == 0 && i + 1 < argc) {
+        if (strcmp(argv[++i], "moesi") == 0) {
+          coherence_protocol = moesi;
+        } else if (strcmp(argv[i], "mesi") == 0) {
+          coherence_protocol = mesi;
+        } else {
+          printf("Unknown coherence protocol\n");
+          exit(0);
+        }
+      } else {
+        printf("Unknown option %s\n", argv[i]);
+        exit(0);
+      }
+    }
   }
 
   cache_info_t cache_info;
@@ -377,15 +2262,31 @@ void main(int argc, char **argv) {
   printf("block_offset_bits %d\n", cache_info.num_block_offset_bits);
   printf("index_bits %d\n", cache_info.num_index_bits);
   printf("num_tag_bits %d\n", cache_info.num_tag_bits);
-  cache_t cache_box;
-  cache_box.data_cache.data = calloc(cache_info.num_blocks, sizeof(uint32_t));
-  cache_box.data_cache.queue = NULL;
-
-  cache_box.instruction_cache.data =
-      calloc(cache_info.num_blocks, sizeof(uint32_t));
-  cache_box.instruction_cache.queue = NULL;
+  // a repeated write to another word still changes the false sharing records
+  if (num_cores > 1 && coalesce) {
+    printf("Accesses are not coalesced with multiple cores\n");
+    coalesce = false;
+  }
+  if (num_cores > 1 && side_cache_entries) {
+    printf("Side caches are not simulated with multiple cores\n");
+    side_cache_entries = 0;
+  }
+  if (side_cache_entries == 0) {
+    side_cache = no_side_cache;
+  }
+  // every access of a request gets its own hit bit
+  if ((server_name || client_name) && coalesce) {
+    printf("Accesses are not coalesced in server mode\n");
+    coalesce = false;
+  }
+  if (server_name) {
+    run_server(server_name, cache_info);
+    exit(0);
+  }
 
-  cache_box.cache_info = cache_info;
+  // with multiple cores cache_box is not used, every core has its own cache
+  cache_t cache_box;
+  coherence_t *system = init_simulation(&cache_box, cache_info);
 
   /* Open the file mem_trace.txt to read memory accesses */
   FILE *ptr_file;
@@ -395,18 +2296,34 @@ void main(int argc, char **argv) {
     exit(1);
   }
 
+  struct timespec start_time, end_time;
+  clock_gettime(CLOCK_MONOTONIC, &start_time);
+  trace_reader_t reader;
+  open_trace_reader(&reader, ptr_file, parse_threads);
+
   /* Loop until whole trace file has been read */
-  mem_access_t access;
-  while (1) {
-    access = read_transaction(ptr_file);
-    // If no transactions left, break out of loop
-    if (access.address == 0) break;
-    // ADD YOUR CODE HERE
-    cache_statistics.accesses++;
-    if (perform_fetch(&cache_box, access)) {
-      cache_statistics.hits++;
-    }
+  // only dm sets are independent, a fa cache is a single set
+  unsigned num_workers = num_threads;
+  if (num_workers > cache_info.num_blocks) {
+    num_workers = cache_info.num_blocks;
   }
+  // the side caches and TLBs are shared by all sets
+  if (side_cache != no_side_cache || tlb_enabled) {
+    num_workers = 1;
+  }
+  if (use_kernels && side_cache == no_side_cache && !tlb_enabled) {
+    simulate_kernel = select_kernel(cache_info);
+  }
+  if (client_name) {
+    cache_statistics = run_client(client_name, &reader);
+  } else if (cache_info.cache_mapping == dm && num_workers > 1) {
+    simulate_trace_parallel(system ? system->cores : &cache_box, &reader,
+                            num_workers, system);
+  } else {
+    simulate_trace(&cache_box, &reader, system);
+  }
+  close_trace_reader(&reader);
+  clock_gettime(CLOCK_MONOTONIC, &end_time);
 
   /* Print the statistics */
   // DO NOT CHANGE THE FOLLOWING LINES!
@@ -418,22 +2335,38 @@ void main(int argc, char **argv) {
          (double)cache_statistics.hits / cache_statistics.accesses);
   // DO NOT CHANGE UNTIL HERE
   // You can extend the memory statistic printing if you like!
+  if (coalesce) {
+    printf("Coalesced: %ld (%.4f of accesses)\n", cache_statistics.coalesced,
+           (double)cache_statistics.coalesced / cache_statistics.accesses);
+  }
+  if (side_cache != no_side_cache) {
+    if (!client_name) {
+      cache_statistics.side_hits = side_cache_hits(&cache_box);
+    }
+    printf("%s hits: %ld (%.4f of misses in the array)\n",
+           (side_cache == victim_cache) ? "Victim" : "Miss cache",
+           cache_statistics.side_hits,
+           (double)cache_statistics.side_hits /
+               (cache_statistics.accesses - cache_statistics.hits +
+                cache_statistics.side_hits));
+  }
+  // a client's caches stay empty, these statistics are in the server
+  if (system && !client_name) {
+    print_coherence_statistics(system);
+  }
+  if (tlb_enabled && !client_name) {
+    if (system) {
+      print_tlb_statistics(system->cores, system->num_cores);
+    } else {
+      print_tlb_statistics(&cache_box, 1);
+    }
+  }
+  if (profile) {
+    print_profile((end_time.tv_sec - start_time.tv_sec) +
+                  (end_time.tv_nsec - start_time.tv_nsec) / 1e9);
+  }
 
   /* Close the trace file */
   fclose(ptr_file);
-  free(cache_box.data_cache.data);
-  free(cache_box.instruction_cache.data);
-  fifo_node_t *counter = cache_box.data_cache.queue;
-  while (counter) {
-    fifo_node_t *temp = counter;
-    counter = counter->next;
-    free(temp);
-  }
-
-  counter = cache_box.instruction_cache.queue;
-  while (counter) {
-    fifo_node_t *temp = counter;
-    counter = counter->next;
-    free(temp);
-  }
+  free_simulation(&cache_box, system);
 }
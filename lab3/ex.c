@@ -8,6 +8,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include <poll.h>
+#include <signal.h>
+
+#include "hat.h"
 
 #define RED_MASK 0xF800
 #define GREEN_MASK 0x7E0
@@ -32,30 +35,42 @@ int positive_modulo(int x, int N) {
   return (x % N + N) %N;
 }
 
-int main() {
-  int fd = open("/dev/fb0", O_RDWR);
-  int fd2 = open("/dev/input/event0", O_RDONLY);
-  short masks[] = {RED_MASK, GREEN_MASK, BLUE_MASK};
-  if (!fd) {
-    printf("could not open fb0");
-    exit(1);
-  }
-  if (!fd2) {
-    printf("could not open event0");
+volatile sig_atomic_t running = 1;
+
+void stop(int signal) {
+  (void) signal;
+  running = 0;
+}
+
+// Usage: ex [--virtual PREFIX], runs until interrupted and then prints the
+// input to pixel latency
+int main(int argc, char **argv) {
+  hatDevice hat;
+  latencyStats latency = {0};
+  char const *virtualHat = (argc == 3 && !strcmp(argv[1], "--virtual")) ? argv[2] : NULL;
+  if (!openHatDevice(&hat, virtualHat)) {
+    printf("could not open sense hat");
     exit(1);
   }
   printf("Successfully opened fb0\n");
 
-  short *fb = (short*) mmap(0, 8 * 8 * sizeof(short), PROT_WRITE | PROT_READ, MAP_SHARED, fd, 0);
+  short *fb = (short*) hat.display;
+  int fd2 = hat.joystick_fd;
   memset(fb, 0, 8 * 8 * 2);
-  close(fd);
+
+  // without SA_RESTART, so the blocking read returns on ^C
+  struct sigaction action = {.sa_handler = stop};
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
 
   int column = 4;
   int row = 4;
   int i = 0;
-  while(1) {
-    read(fd2, &ev, sizeof(struct input_event));
-    if (ev.value != 0) {
+  while(running) {
+    if (read(fd2, &ev, sizeof(struct input_event)) != sizeof(struct input_event))
+      continue;
+    if (ev.type == EV_KEY && ev.value != 0) {
+      latencyInput(&latency, eventTime(&ev));
       printf("code is: %d", ev.code);
       fb[column * 8 + row] = 0;
       switch (ev.code) {
@@ -75,8 +90,13 @@ int main() {
       printf("column: %d, row: %d", column, row);
       printf("index: %d\n", column * 8 + row);
       fb[column * 8 + row] = WHITE;
+      latencyDisplayed(&latency);
     }
   }
+
+  printLatency(stdout, &latency);
+  closeHatDevice(&hat);
+  return 0;
 }
 
 
@@ -0,0 +1,195 @@
+#ifndef HAT_H
+#define HAT_H
+
+// Display and input backend shared by stetris.c and ex.c. It opens either the
+// real RPi Sense HAT or a virtual one, and measures input-to-pixel latency.
+//
+// The virtual HAT lives at two files next to a path prefix:
+//   <prefix>.fb  - the 8x8 RGB565 framebuffer, a 128 byte file mmapped shared,
+//                  so another process can map it to watch the display
+//   <prefix>.joy - a FIFO read like the joystick evdev device, fed with raw
+//                  struct input_event records. Event times are taken as
+//                  CLOCK_MONOTONIC, a zero time means "when read".
+// Both are created if they do not exist.
+//
+// Header only with static functions, so each lab program stays a single
+// translation unit.
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <linux/fb.h>
+#include <linux/input.h>
+
+#define HAT_PIXELS (8 * 8)
+
+typedef struct {
+  unsigned short *display; // 8x8 RGB565 pixels, row-major
+  int joystick_fd;         // delivers struct input_event
+  bool isVirtual;
+} hatDevice;
+
+static bool openRealHat(hatDevice *dev) {
+  struct fb_fix_screeninfo info;
+  char led_address[] = "/dev/fb0";
+  char joy_address[] = "/dev/input/event0";
+  char joystick_name[256];
+  int const ix = 7;
+  int const joy_ix = 16;
+  int fd = -1;
+
+  for (int i = 0; i < 10; ++i, led_address[ix]++) {
+    fd = open(led_address, O_RDWR);
+    if (fd < 0)
+      continue;
+    if (!ioctl(fd, FBIOGET_FSCREENINFO, &info) && !strcmp("RPi-Sense FB", info.id)) {
+      printf("found correct sense hat led\n");
+      break;
+    }
+    close(fd);
+    fd = -1;
+  }
+  if (fd < 0) {
+    printf("could not find sense hat led\n");
+    return false;
+  }
+
+  dev->joystick_fd = -1;
+  for (int i = 0; i < 10; ++i, joy_address[joy_ix]++) {
+    dev->joystick_fd = open(joy_address, O_RDONLY);
+    if (dev->joystick_fd < 0)
+      continue;
+    if (ioctl(dev->joystick_fd, EVIOCGNAME(sizeof(joystick_name)), joystick_name) >= 0 &&
+        !strcmp(joystick_name, "Raspberry Pi Sense HAT Joystick")) {
+      printf("Found correct sense hat joystick\n");
+      break;
+    }
+    close(dev->joystick_fd);
+    dev->joystick_fd = -1;
+  }
+  if (dev->joystick_fd < 0) {
+    printf("Could not find sense hat joystick\n");
+    close(fd);
+    return false;
+  }
+  // stamp events with the clock the latency is measured on
+  int clock = CLOCK_MONOTONIC;
+  ioctl(dev->joystick_fd, EVIOCSCLOCKID, &clock);
+
+  dev->display = mmap(0, HAT_PIXELS * sizeof(short), PROT_WRITE | PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  return dev->display != MAP_FAILED;
+}
+
+static bool openVirtualHat(hatDevice *dev, char const *prefix) {
+  char path[PATH_MAX];
+
+  snprintf(path, sizeof(path), "%s.fb", prefix);
+  int const fd = open(path, O_RDWR | O_CREAT, 0644);
+  if (fd < 0 || ftruncate(fd, HAT_PIXELS * sizeof(short))) {
+    printf("could not create virtual framebuffer %s\n", path);
+    return false;
+  }
+  dev->display = mmap(0, HAT_PIXELS * sizeof(short), PROT_WRITE | PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (dev->display == MAP_FAILED)
+    return false;
+
+  // opened for writing too, so the FIFO never reports end of file when the
+  // feeding process goes away
+  snprintf(path, sizeof(path), "%s.joy", prefix);
+  mkfifo(path, 0644);
+  dev->joystick_fd = open(path, O_RDWR);
+  if (dev->joystick_fd < 0) {
+    printf("could not open virtual joystick %s\n", path);
+    munmap(dev->display, HAT_PIXELS * sizeof(short));
+    return false;
+  }
+  return true;
+}
+
+// Opens the virtual HAT at prefix, or the real one if prefix is NULL
+static bool openHatDevice(hatDevice *dev, char const *prefix) {
+  dev->isVirtual = prefix != NULL;
+  return dev->isVirtual ? openVirtualHat(dev, prefix) : openRealHat(dev);
+}
+
+static void closeHatDevice(hatDevice *dev) {
+  munmap(dev->display, HAT_PIXELS * sizeof(short));
+  close(dev->joystick_fd);
+}
+
+// Input-to-pixel latency: every input that changes the display is stamped,
+// and when pixels are next written to the framebuffer the time since each
+// stamp goes into a log2 histogram of microseconds.
+#define LATENCY_PENDING 64
+#define LATENCY_BUCKETS 32
+
+typedef struct {
+  struct timespec pending[LATENCY_PENDING]; // inputs not yet displayed
+  unsigned int pendingCount;
+  unsigned long buckets[LATENCY_BUCKETS];   // bucket b counts [2^(b-1), 2^b) us
+  unsigned long samples;
+  unsigned long long totalUSec;
+  unsigned long maxUSec;
+} latencyStats;
+
+// Time of an input event, now if the event carries none
+static struct timespec eventTime(struct input_event const *event) {
+  struct timespec time;
+  if (event->time.tv_sec || event->time.tv_usec) {
+    time.tv_sec = event->time.tv_sec;
+    time.tv_nsec = event->time.tv_usec * 1000;
+  } else {
+    clock_gettime(CLOCK_MONOTONIC, &time);
+  }
+  return time;
+}
+
+static void latencyInput(latencyStats *stats, struct timespec const time) {
+  if (stats->pendingCount < LATENCY_PENDING)
+    stats->pending[stats->pendingCount++] = time;
+}
+
+static void latencyDisplayed(latencyStats *stats) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  for (unsigned int i = 0; i < stats->pendingCount; i++) {
+    long long const nSec = (now.tv_sec - stats->pending[i].tv_sec) * 1000000000LL +
+                           (now.tv_nsec - stats->pending[i].tv_nsec);
+    unsigned long const uSec = nSec > 0 ? nSec / 1000 : 0;
+    unsigned int bucket = 0;
+    while (bucket < LATENCY_BUCKETS - 1 && (uSec >> bucket))
+      bucket++;
+    stats->buckets[bucket]++;
+    stats->samples++;
+    stats->totalUSec += uSec;
+    if (uSec > stats->maxUSec)
+      stats->maxUSec = uSec;
+  }
+  stats->pendingCount = 0;
+}
+
+static void printLatency(FILE *out, latencyStats const *stats) {
+  if (!stats->samples)
+    return;
+  fprintf(out, "Input to pixel latency: %lu samples, mean %llu us, max %lu us\n", stats->samples,
+          stats->totalUSec / stats->samples, stats->maxUSec);
+  unsigned long seen = 0;
+  for (unsigned int b = 0; b < LATENCY_BUCKETS; b++) {
+    if (!stats->buckets[b])
+      continue;
+    seen += stats->buckets[b];
+    fprintf(out, "  < %10lu us %8lu %6.2f%%\n", 1UL << b, stats->buckets[b],
+            100.0 * seen / stats->samples);
+  }
+}
+
+#endif
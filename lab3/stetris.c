@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <termios.h>
@@ -13,6 +14,12 @@
 #include <sys/mman.h>
 #include <poll.h>
 #include <limits.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+#include "hat.h"
 
 #define RED_MASK 0xF800
 #define GREEN_MASK 0x7E0
@@ -32,6 +39,19 @@
 #define LEFT 105
 #define RIGHT 106
 
+// Joystick events are drained with one read() of up to JOY_BATCH events into
+// a queue of keys that have not been played yet
+#define JOY_BATCH 32
+#define KEY_QUEUE_SIZE 16
+
+// The playfield is stored as a bitboard by default: one word per row with bit x
+// set when tile x is occupied, and the colors in a separate plane. Build with
+// -DTILE_PLAYFIELD to use the array of tile structs instead.
+#ifndef TILE_PLAYFIELD
+typedef uint64_t rowBits;
+#define MAX_GRID_X (sizeof(rowBits) * CHAR_BIT)
+#endif
+
 // If you extend this structure, either avoid pointers or adjust
 // the game logic allocate/deallocate and reset the memory
 typedef struct {
@@ -47,6 +67,16 @@ typedef struct {
 typedef struct {
   unsigned short *display;
   int joystick_fd;
+  hatDevice device;                          // real or virtual hat
+  int keys[KEY_QUEUE_SIZE];                  // pending joystick keys, oldest at keyHead
+  struct timespec keyTimes[KEY_QUEUE_SIZE];  // when each key was pressed
+  unsigned int keyHead;
+  unsigned int keyCount;
+  // start of an event the virtual FIFO delivered only in part
+  unsigned char partialEvent[sizeof(struct input_event)];
+  size_t partialBytes;
+  struct timespec keyTime;                   // press time of the key read last
+  latencyStats latency;
 } Hat;
 
 
@@ -61,8 +91,13 @@ typedef struct {
   unsigned int score; // game score
   unsigned int level; // game level
 
+#ifdef TILE_PLAYFIELD
   tile *rawPlayfield; // pointer to raw memory of the playfield
   tile **playfield;   // This is the play field array
+#else
+  rowBits *occupancy; // bit x of occupancy[y] is set if tile (x, y) is occupied
+  short *colors;      // color of tile (x, y) at colors[y * grid.x + x]
+#endif
   unsigned int state;
   coord activeTile;                       // current tile
 
@@ -75,6 +110,20 @@ typedef struct {
 
 Hat hat;
 
+// The renderers remember the last frame they drew and only redraw what
+// differs from it. The first frame is drawn in full.
+#define STATUS_LENGTH 24
+typedef struct {
+  bool consoleDrawn;
+  bool matrixDrawn;
+  char *cells;                   // '#' or ' ' for tile (x, y) at cells[y * grid.x + x]
+  char (*status)[STATUS_LENGTH]; // text right of the playfield, one per row
+  char *output;                  // console output of one frame
+  unsigned short pixels[8 * 8];  // LED matrix as last drawn
+} frameCache;
+
+frameCache frame;
+
 gameConfig game = {
                    .grid = {8, 8},
                    .uSecTickTime = 10000,
@@ -86,131 +135,156 @@ gameConfig game = {
 // This function is called on the start of your application
 // Here you can initialize what ever you need for your task
 // return false if something fails, else true
-bool initializeSenseHat() {
-  printf("initializing sense hat");
-  struct fb_fix_screeninfo info;
-  bool found = false;
-  char led_address[] = "/dev/fb0";
-  char joy_address[] = "/dev/input/event0";
-  char joystick_name[256];
-  int ix = 7;
-  int joy_ix = 16;
-  int fd;
-  for (int i = 0; i < 10; ++i) {
-    fd = open(led_address, O_RDWR);
-    if (!fd) {
-      printf("could not open fd\n");
-    }
-    else {
-      printf("ioctl\n");
-      ioctl(fd, FBIOGET_FSCREENINFO, &info);
-      printf("%s", info.id);
-      if (!strcmp("RPi-Sense FB", info.id)) {
-        printf("found correct sense hat led\n");
-        break;
-      }
-      else {
-        printf("did not find sense hat led\n");
-        close(fd);
-      }
-    }
-    if (i == 9) {
-      printf("could not find sense hat, exiting\n");
-      exit(1);
-    }
-    led_address[ix]++;
-  }
-
-  for (int i = 0; i < 10; ++i) {
-    hat.joystick_fd = open(joy_address, O_RDONLY);
-    if (hat.joystick_fd) {
-       ioctl(hat.joystick_fd, EVIOCGNAME(sizeof(joystick_name)), joystick_name);
-       if (!strcmp(joystick_name, "Raspberry Pi Sense HAT Joystick")) {
-         printf("Found correct sense hat joystick\n");
-         break;
-       }
-    }
-    else {
-      printf("could not open fb0\n");
-    }
-    if (i == 9) {
-      printf("Could not find sense hat joystick, exiting\n");
-        exit(1);
-    }
-    joy_address[joy_ix]++;
-  }
-
-
-  hat.display = (short*) mmap(0, 8 * 8 * sizeof(short), PROT_WRITE | PROT_READ, MAP_SHARED, fd, 0);
-  close(fd);
+// With a path prefix, the virtual hat of hat.h is used instead of the real one
+bool initializeSenseHat(char const *virtualHat) {
+  if (!openHatDevice(&hat.device, virtualHat))
+    return false;
+  hat.display = hat.device.display;
+  hat.joystick_fd = hat.device.joystick_fd;
+  // the joystick is drained until it would block
+  fcntl(hat.joystick_fd, F_SETFL, fcntl(hat.joystick_fd, F_GETFL) | O_NONBLOCK);
   return true;
 }
 
 // This function is called when the application exits
 // Here you can free up everything that you might have opened/allocated
 void freeSenseHat() {
-  close(hat.joystick_fd);
+  closeHatDevice(&hat.device);
+}
+
+int joystickKey(unsigned short const code) {
+  switch (code) {
+    case LEFT:
+      return KEY_LEFT;
+    case UP:
+      return KEY_UP;
+    case DOWN:
+      return KEY_DOWN;
+    case RIGHT:
+      return KEY_RIGHT;
+    case JOY_ENTER:
+      return KEY_ENTER;
+    default:
+      return 0;
+  }
+}
+
+// Reads pending joystick events and queues the key presses. Releases and
+// EV_SYN are skipped, autorepeat (value 2) only repeats sideways moves since a
+// repeated drop or start would play a key the user did not press again.
+// Reading stops when the queue is full, the events left wait in the device
+// until the queue has room again.
+void drainSenseHatJoystick() {
+  struct input_event events[JOY_BATCH];
+  size_t const eventSize = sizeof(struct input_event);
+  while (hat.keyCount < KEY_QUEUE_SIZE) {
+    // an event queues at most one key, so never read more than there is room for
+    size_t wanted = KEY_QUEUE_SIZE - hat.keyCount;
+    if (wanted > JOY_BATCH)
+      wanted = JOY_BATCH;
+    memcpy(events, hat.partialEvent, hat.partialBytes);
+    ssize_t const bytes = read(hat.joystick_fd, (unsigned char *) events + hat.partialBytes,
+                               wanted * eventSize - hat.partialBytes);
+    if (bytes <= 0)
+      break;
+    size_t const total = hat.partialBytes + bytes;
+    size_t const complete = total / eventSize;
+    hat.partialBytes = total % eventSize;
+    memcpy(hat.partialEvent, (unsigned char *) events + complete * eventSize, hat.partialBytes);
+    for (size_t i = 0; i < complete; i++) {
+      if (events[i].type != EV_KEY || events[i].value == 0)
+        continue;
+      int const key = joystickKey(events[i].code);
+      if (!key || (events[i].value == 2 && key != KEY_LEFT && key != KEY_RIGHT))
+        continue;
+      unsigned int const slot = (hat.keyHead + hat.keyCount++) % KEY_QUEUE_SIZE;
+      hat.keys[slot] = key;
+      hat.keyTimes[slot] = eventTime(&events[i]);
+    }
+    if (total < wanted * eventSize)
+      break;
+  }
 }
 
 // This function should return the key that corresponds to the joystick press
 // KEY_UP, KEY_DOWN, KEY_LEFT, KEY_RIGHT, with the respective direction
 // and KEY_ENTER, when the the joystick is pressed
 // !!! when nothing was pressed you MUST return 0 !!!
+// Keys come from the queue, which is refilled when it runs empty.
 int readSenseHatJoystick() {
-  struct pollfd pollStdin = {
-       .fd = hat.joystick_fd,
-       .events = POLLIN
-  };
+  if (!hat.keyCount)
+    drainSenseHatJoystick();
+  if (!hat.keyCount)
+    return 0;
+  int const key = hat.keys[hat.keyHead];
+  hat.keyTime = hat.keyTimes[hat.keyHead];
+  hat.keyHead = (hat.keyHead + 1) % KEY_QUEUE_SIZE;
+  hat.keyCount--;
+  return key;
+}
 
-  struct input_event joy_evt;
+#ifdef TILE_PLAYFIELD
+static inline bool tileOccupied(gameConfig *game, coord const target) {
+  return game->playfield[target.y][target.x].occupied;
+}
 
-  if (poll(&pollStdin, 1, 0)) {
-    read(hat.joystick_fd, &joy_evt, sizeof(struct input_event));
-    if (joy_evt.value != 0) {
-      switch (joy_evt.code) {
-        case LEFT:
-          return KEY_LEFT;
-        case UP:
-          return KEY_UP;
-        case DOWN:
-          return KEY_DOWN;
-        case RIGHT:
-          return KEY_RIGHT;
-        case JOY_ENTER:
-          return KEY_ENTER;
-        default:
-          return 0;
-      }
-    }
-  }
-  return 0;
+static inline short tileColor(gameConfig *game, coord const target) {
+  return game->playfield[target.y][target.x].color;
+}
+#else
+static inline bool tileOccupied(gameConfig *game, coord const target) {
+  return (game->occupancy[target.y] >> target.x) & 1;
 }
 
-static inline bool tileOccupied(coord const target) {
-  return game.playfield[target.y][target.x].occupied;
+static inline short tileColor(gameConfig *game, coord const target) {
+  return game->colors[target.y * game->grid.x + target.x];
 }
+#endif
 
-short getColor() {
+short getColor(gameConfig *game) {
   short var = (GREEN_MASK | BLUE_MASK);
   var /= 30;
-  var *= game.tiles % 30;
+  var *= game->tiles % 30;
   return RED_MASK | var;
 }
 
+bool initializeRenderer(gameConfig *game) {
+  // a full frame or a diff of every cell and status line, with room to spare
+  size_t const outputSize = (game->grid.x + 8) * (game->grid.y + 2) * 16 + game->grid.y * (STATUS_LENGTH + 16);
+  frame.cells = malloc(game->grid.x * game->grid.y);
+  frame.status = calloc(game->grid.y, STATUS_LENGTH);
+  frame.output = malloc(outputSize);
+  frame.consoleDrawn = false;
+  frame.matrixDrawn = false;
+  return frame.cells && frame.status && frame.output;
+}
+
+void freeRenderer() {
+  free(frame.cells);
+  free(frame.status);
+  free(frame.output);
+}
+
 // This function should render the gamefield on the LED matrix. It is called
 // every game tick. The parameter playfieldChanged signals whether the game logic
 // has changed the playfield
-void renderSenseHatMatrix(bool const playfieldChanged) {
-  (void) playfieldChanged;
+// Only pixels that differ from the last frame are written to the framebuffer.
+void renderSenseHatMatrix(gameConfig *game, bool const playfieldChanged) {
   if (!playfieldChanged)
     return;
-  // Goto beginning of console
-  for (unsigned int y = 0; y < game.grid.y; y++) {
-    for (unsigned int x = 0; x < game.grid.x; x++) {
+  for (unsigned int y = 0; y < game->grid.y; y++) {
+    for (unsigned int x = 0; x < game->grid.x; x++) {
       coord const checkTile = {x, y};
-      hat.display[y * 8 + x] = (tileOccupied(checkTile)) ? game.playfield[y][x].color : 0;
+      unsigned short const pixel = (tileOccupied(game, checkTile)) ? tileColor(game, checkTile) : 0;
+      if (!frame.matrixDrawn || frame.pixels[y * 8 + x] != pixel) {
+        frame.pixels[y * 8 + x] = pixel;
+        hat.display[y * 8 + x] = pixel;
+      }
     }
   }
+  frame.matrixDrawn = true;
+  // the keys played since the last frame are on the display now
+  latencyDisplayed(&hat.latency);
 }
 
 
@@ -218,42 +292,79 @@ void renderSenseHatMatrix(bool const playfieldChanged) {
 // if you choose to change the playfield or the tile structure, you might need to
 // adjust this game logic <> playfield interface
 
-static inline void newTile(coord const target) {
-  game.playfield[target.y][target.x].occupied = true;
-  game.playfield[target.y][target.x].color = getColor();
+#ifdef TILE_PLAYFIELD
+static inline void newTile(gameConfig *game, coord const target) {
+  game->playfield[target.y][target.x].occupied = true;
+  game->playfield[target.y][target.x].color = getColor(game);
 }
 
-static inline void copyTile(coord const to, coord const from) {
-  memcpy((void *) &game.playfield[to.y][to.x], (void *) &game.playfield[from.y][from.x], sizeof(tile));
+static inline void copyTile(gameConfig *game, coord const to, coord const from) {
+  memcpy((void *) &game->playfield[to.y][to.x], (void *) &game->playfield[from.y][from.x], sizeof(tile));
 }
 
-static inline void copyRow(unsigned int const to, unsigned int const from) {
-  memcpy((void *) &game.playfield[to][0], (void *) &game.playfield[from][0], sizeof(tile) * game.grid.x);
+static inline void copyRow(gameConfig *game, unsigned int const to, unsigned int const from) {
+  memcpy((void *) &game->playfield[to][0], (void *) &game->playfield[from][0], sizeof(tile) * game->grid.x);
 
 }
 
-static inline void resetTile(coord const target) {
-  memset((void *) &game.playfield[target.y][target.x], 0, sizeof(tile));
+static inline void resetTile(gameConfig *game, coord const target) {
+  memset((void *) &game->playfield[target.y][target.x], 0, sizeof(tile));
 }
 
-static inline void resetRow(unsigned int const target) {
-  memset((void *) &game.playfield[target][0], 0, sizeof(tile) * game.grid.x);
+static inline void resetRow(gameConfig *game, unsigned int const target) {
+  memset((void *) &game->playfield[target][0], 0, sizeof(tile) * game->grid.x);
 }
 
-static inline bool rowOccupied(unsigned int const target) {
-  for (unsigned int x = 0; x < game.grid.x; x++) {
+static inline bool rowOccupied(gameConfig *game, unsigned int const target) {
+  for (unsigned int x = 0; x < game->grid.x; x++) {
     coord const checkTile = {x, target};
-    if (!tileOccupied(checkTile)) {
+    if (!tileOccupied(game, checkTile)) {
       return false;
     }
   }
   return true;
 }
+#else
+static inline void newTile(gameConfig *game, coord const target) {
+  game->occupancy[target.y] |= (rowBits) 1 << target.x;
+  game->colors[target.y * game->grid.x + target.x] = getColor(game);
+}
+
+static inline void copyTile(gameConfig *game, coord const to, coord const from) {
+  rowBits const fromBit = (rowBits) 1 << from.x;
+  rowBits const toBit = (rowBits) 1 << to.x;
+  if (game->occupancy[from.y] & fromBit)
+    game->occupancy[to.y] |= toBit;
+  else
+    game->occupancy[to.y] &= ~toBit;
+  game->colors[to.y * game->grid.x + to.x] = game->colors[from.y * game->grid.x + from.x];
+}
+
+static inline void copyRow(gameConfig *game, unsigned int const to, unsigned int const from) {
+  game->occupancy[to] = game->occupancy[from];
+  memcpy((void *) &game->colors[to * game->grid.x], (void *) &game->colors[from * game->grid.x], sizeof(short) * game->grid.x);
+}
+
+static inline void resetTile(gameConfig *game, coord const target) {
+  game->occupancy[target.y] &= ~((rowBits) 1 << target.x);
+  game->colors[target.y * game->grid.x + target.x] = 0;
+}
+
+static inline void resetRow(gameConfig *game, unsigned int const target) {
+  game->occupancy[target] = 0;
+  memset((void *) &game->colors[target * game->grid.x], 0, sizeof(short) * game->grid.x);
+}
+
+static inline bool rowOccupied(gameConfig *game, unsigned int const target) {
+  rowBits const fullRow = (game->grid.x == MAX_GRID_X) ? ~(rowBits) 0 : ((rowBits) 1 << game->grid.x) - 1;
+  return game->occupancy[target] == fullRow;
+}
+#endif
 
 
-static inline void resetPlayfield() {
-  for (unsigned int y = 0; y < game.grid.y; y++) {
-    resetRow(y);
+static inline void resetPlayfield(gameConfig *game) {
+  for (unsigned int y = 0; y < game->grid.y; y++) {
+    resetRow(game, y);
   }
 }
 
@@ -261,110 +372,110 @@ static inline void resetPlayfield() {
 // that means no changes are necessary below this line! And if you choose to change something
 // keep it compatible with what was provided to you!
 
-bool addNewTile() {
-  game.activeTile.y = 0;
-  game.activeTile.x = (game.grid.x - 1) / 2;
-  if (tileOccupied(game.activeTile))
+bool addNewTile(gameConfig *game) {
+  game->activeTile.y = 0;
+  game->activeTile.x = (game->grid.x - 1) / 2;
+  if (tileOccupied(game, game->activeTile))
     return false;
-  newTile(game.activeTile);
+  newTile(game, game->activeTile);
   return true;
 }
 
-bool moveRight() {
-  coord const newTile = {game.activeTile.x + 1, game.activeTile.y};
-  if (game.activeTile.x < (game.grid.x - 1) && !tileOccupied(newTile)) {
-    copyTile(newTile, game.activeTile);
-    resetTile(game.activeTile);
-    game.activeTile = newTile;
+bool moveRight(gameConfig *game) {
+  coord const newTile = {game->activeTile.x + 1, game->activeTile.y};
+  if (game->activeTile.x < (game->grid.x - 1) && !tileOccupied(game, newTile)) {
+    copyTile(game, newTile, game->activeTile);
+    resetTile(game, game->activeTile);
+    game->activeTile = newTile;
     return true;
   }
   return false;
 }
 
-bool moveLeft() {
-  coord const newTile = {game.activeTile.x - 1, game.activeTile.y};
-  if (game.activeTile.x > 0 && !tileOccupied(newTile)) {
-    copyTile(newTile, game.activeTile);
-    resetTile(game.activeTile);
-    game.activeTile = newTile;
+bool moveLeft(gameConfig *game) {
+  coord const newTile = {game->activeTile.x - 1, game->activeTile.y};
+  if (game->activeTile.x > 0 && !tileOccupied(game, newTile)) {
+    copyTile(game, newTile, game->activeTile);
+    resetTile(game, game->activeTile);
+    game->activeTile = newTile;
     return true;
   }
   return false;
 }
 
 
-bool moveDown() {
-  coord const newTile = {game.activeTile.x, game.activeTile.y + 1};
-  if (game.activeTile.y < (game.grid.y - 1) && !tileOccupied(newTile)) {
-    copyTile(newTile, game.activeTile);
-    resetTile(game.activeTile);
-    game.activeTile = newTile;
+bool moveDown(gameConfig *game) {
+  coord const newTile = {game->activeTile.x, game->activeTile.y + 1};
+  if (game->activeTile.y < (game->grid.y - 1) && !tileOccupied(game, newTile)) {
+    copyTile(game, newTile, game->activeTile);
+    resetTile(game, game->activeTile);
+    game->activeTile = newTile;
     return true;
   }
   return false;
 }
 
 
-bool clearRow() {
-  if (rowOccupied(game.grid.y - 1)) {
-    for (unsigned int y = game.grid.y - 1; y > 0; y--) {
-      copyRow(y, y - 1);
+bool clearRow(gameConfig *game) {
+  if (rowOccupied(game, game->grid.y - 1)) {
+    for (unsigned int y = game->grid.y - 1; y > 0; y--) {
+      copyRow(game, y, y - 1);
     }
-    resetRow(0);
+    resetRow(game, 0);
     return true;
   }
   return false;
 }
 
-void advanceLevel() {
-  game.level++;
-  switch(game.nextGameTick) {
+void advanceLevel(gameConfig *game) {
+  game->level++;
+  switch(game->nextGameTick) {
   case 1:
     break;
   case 2 ... 10:
-    game.nextGameTick--;
+    game->nextGameTick--;
     break;
   case 11 ... 20:
-    game.nextGameTick -= 2;
+    game->nextGameTick -= 2;
     break;
   default:
-    game.nextGameTick -= 10;
+    game->nextGameTick -= 10;
   }
 }
 
-void newGame() {
-  game.state = ACTIVE;
-  game.tiles = 0;
-  game.rows = 0;
-  game.score = 0;
-  game.tick = 0;
-  game.level = 0;
-  resetPlayfield();
+void newGame(gameConfig *game) {
+  game->state = ACTIVE;
+  game->tiles = 0;
+  game->rows = 0;
+  game->score = 0;
+  game->tick = 0;
+  game->level = 0;
+  resetPlayfield(game);
 }
 
-void gameOver() {
-  game.state = GAMEOVER;
-  game.nextGameTick = game.initNextGameTick;
+void gameOver(gameConfig *game) {
+  game->state = GAMEOVER;
+  game->nextGameTick = game->initNextGameTick;
 }
 
 
-bool sTetris(int const key) {
+bool sTetris(gameConfig *game, int const key) {
   bool playfieldChanged = false;
 
-  if (game.state & ACTIVE) {
+  if (game->state & ACTIVE) {
     // Move the current tile
     if (key) {
       playfieldChanged = true;
       switch(key) {
       case KEY_LEFT:
-        moveLeft();
+        moveLeft(game);
         break;
       case KEY_RIGHT:
-        moveRight();
+        moveRight(game);
         break;
       case KEY_DOWN:
-        while (moveDown()) {};
-        game.tick = 0;
+        while (moveDown(game)) {};
+        game->tick = 0;
         break;
       default:
         playfieldChanged = false;
@@ -372,42 +483,42 @@ bool sTetris(int const key) {
     }
 
     // If we have reached a tick to update the game
-    if (game.tick == 0) {
+    if (game->tick == 0) {
       // We communicate the row clear and tile add over the game state
       // clear these bits if they were set before
-      game.state &= ~(ROW_CLEAR | TILE_ADDED);
+      game->state &= ~(ROW_CLEAR | TILE_ADDED);
 
       playfieldChanged = true;
       // Clear row if possible
-      if (clearRow()) {
-        game.state |= ROW_CLEAR;
-        game.rows++;
-        game.score += game.level + 1;
-        if ((game.rows % game.rowsPerLevel) == 0) {
-          advanceLevel();
+      if (clearRow(game)) {
+        game->state |= ROW_CLEAR;
+        game->rows++;
+        game->score += game->level + 1;
+        if ((game->rows % game->rowsPerLevel) == 0) {
+          advanceLevel(game);
         }
       }
 
       // if there is no current tile or we cannot move it down,
       // add a new one. If not possible, game over.
-      if (!tileOccupied(game.activeTile) || !moveDown()) {
-        if (addNewTile()) {
-          game.state |= TILE_ADDED;
-          game.tiles++;
+      if (!tileOccupied(game, game->activeTile) || !moveDown(game)) {
+        if (addNewTile(game)) {
+          game->state |= TILE_ADDED;
+          game->tiles++;
         } else {
-          gameOver();
+          gameOver(game);
         }
       }
     }
   }
 
   // Press any key to start a new game
-  if ((game.state == GAMEOVER) && key) {
+  if ((game->state == GAMEOVER) && key) {
     playfieldChanged = true;
-    newGame();
-    addNewTile();
-    game.state |= TILE_ADDED;
-    game.tiles++;
+    newGame(game);
+    addNewTile(game);
+    game->state |= TILE_ADDED;
+    game->tiles++;
   }
 
   return playfieldChanged;
@@ -440,55 +551,601 @@ int readKeyboard() {
   return 0;
 }
 
-void renderConsole(bool const playfieldChanged) {
+// Text right of row y of the playfield, empty for rows without one
+void statusLine(gameConfig *game, unsigned int const y, char *status) {
+  switch (y) {
+    case 0:
+      snprintf(status, STATUS_LENGTH, " Tiles: %10u", game->tiles);
+      break;
+    case 1:
+      snprintf(status, STATUS_LENGTH, " Rows:  %10u", game->rows);
+      break;
+    case 2:
+      snprintf(status, STATUS_LENGTH, " Score: %10u", game->score);
+      break;
+    case 4:
+      snprintf(status, STATUS_LENGTH, " Level: %10u", game->level);
+      break;
+    case 7:
+      snprintf(status, STATUS_LENGTH, " %17s", (game->state == GAMEOVER) ? "Game Over" : "");
+      break;
+    default:
+      status[0] = '\0';
+  }
+}
+
+// Writes all of buffer, retrying interrupted and partial writes
+bool writeAll(int const fd, char const *buffer, size_t length) {
+  while (length) {
+    ssize_t const written = write(fd, buffer, length);
+    if (written < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        return false;
+      struct pollfd pollOut = {.fd = fd, .events = POLLOUT};
+      poll(&pollOut, 1, -1);
+      continue;
+    }
+    buffer += written;
+    length -= written;
+  }
+  return true;
+}
+
+// The frame is assembled in frame.output and written with a single write().
+// The first frame clears the console and draws everything, later ones move
+// the cursor to each changed tile and status line and redraw only those.
+// If the frame cannot be written, the next one is drawn in full.
+void renderConsole(gameConfig *game, bool const playfieldChanged) {
   if (!playfieldChanged)
     return;
-  // Goto beginning of console
-  fprintf(stdout, "\033[%d;%dH", 0, 0);
-  for (unsigned int x = 0; x < game.grid.x + 2; x ++) {
-    fprintf(stdout, "-");
-  }
-  fprintf(stdout, "\n");
-  for (unsigned int y = 0; y < game.grid.y; y++) {
-    fprintf(stdout, "|");
-    for (unsigned int x = 0; x < game.grid.x; x++) {
-      coord const checkTile = {x, y};
-      fprintf(stdout, "%c", (tileOccupied(checkTile)) ? '#' : ' ');
+  char *out = frame.output;
+  char status[STATUS_LENGTH];
+
+  if (!frame.consoleDrawn) {
+    // Clear console
+    out += sprintf(out, "\033[H\033[J");
+    memset(out, '-', game->grid.x + 2);
+    out += game->grid.x + 2;
+    *out++ = '\n';
+    for (unsigned int y = 0; y < game->grid.y; y++) {
+      *out++ = '|';
+      for (unsigned int x = 0; x < game->grid.x; x++) {
+        coord const checkTile = {x, y};
+        frame.cells[y * game->grid.x + x] = (tileOccupied(game, checkTile)) ? '#' : ' ';
+        *out++ = frame.cells[y * game->grid.x + x];
+      }
+      statusLine(game, y, frame.status[y]);
+      out += sprintf(out, "|%s\n", frame.status[y]);
     }
-    switch (y) {
-      case 0:
-        fprintf(stdout, "| Tiles: %10u\n", game.tiles);
-        break;
-      case 1:
-        fprintf(stdout, "| Rows:  %10u\n", game.rows);
-        break;
-      case 2:
-        fprintf(stdout, "| Score: %10u\n", game.score);
-        break;
-      case 4:
-        fprintf(stdout, "| Level: %10u\n", game.level);
+    memset(out, '-', game->grid.x + 2);
+    out += game->grid.x + 2;
+    frame.consoleDrawn = true;
+  } else {
+    // Rows and columns of the console start at 1, the playfield at (2, 2)
+    for (unsigned int y = 0; y < game->grid.y; y++) {
+      for (unsigned int x = 0; x < game->grid.x; x++) {
+        coord const checkTile = {x, y};
+        char const cell = (tileOccupied(game, checkTile)) ? '#' : ' ';
+        if (frame.cells[y * game->grid.x + x] != cell) {
+          frame.cells[y * game->grid.x + x] = cell;
+          out += sprintf(out, "\033[%u;%uH%c", y + 2, x + 2, cell);
+        }
+      }
+      statusLine(game, y, status);
+      if (strcmp(frame.status[y], status)) {
+        strcpy(frame.status[y], status);
+        out += sprintf(out, "\033[%u;%uH%s", y + 2, game->grid.x + 3, status);
+      }
+    }
+    if (out == frame.output)
+      return;
+    // leave the cursor behind the bottom line like a full frame does
+    out += sprintf(out, "\033[%u;%uH", game->grid.y + 2, game->grid.x + 3);
+  }
+  if (!writeAll(STDOUT_FILENO, frame.output, out - frame.output))
+    frame.consoleDrawn = false;
+}
+
+
+inline unsigned long uSecFromTimespec(struct timespec const ts) {
+  return ((ts.tv_sec * 1000000) + (ts.tv_nsec / 1000));
+}
+
+// Allocate the playing field structure
+bool allocatePlayfield(gameConfig *game) {
+#ifdef TILE_PLAYFIELD
+  game->rawPlayfield = (tile *) malloc(game->grid.x * game->grid.y * sizeof(tile));
+  game->playfield = (tile**) malloc(game->grid.y * sizeof(tile *));
+  if (!game->playfield || !game->rawPlayfield) {
+    fprintf(stderr, "ERROR: could not allocate playfield\n");
+    return false;
+  }
+  for (unsigned int y = 0; y < game->grid.y; y++) {
+    game->playfield[y] = &(game->rawPlayfield[y * game->grid.x]);
+  }
+#else
+  if (game->grid.x > MAX_GRID_X) {
+    fprintf(stderr, "ERROR: playfield can be at most %zu tiles wide\n", MAX_GRID_X);
+    return false;
+  }
+  game->occupancy = (rowBits *) malloc(game->grid.y * sizeof(rowBits));
+  game->colors = (short *) malloc(game->grid.x * game->grid.y * sizeof(short));
+  if (!game->occupancy || !game->colors) {
+    fprintf(stderr, "ERROR: could not allocate playfield\n");
+    return false;
+  }
+#endif
+  return true;
+}
+
+void freePlayfield(gameConfig *game) {
+#ifdef TILE_PLAYFIELD
+  free(game->playfield);
+  free(game->rawPlayfield);
+#else
+  free(game->occupancy);
+  free(game->colors);
+#endif
+}
+
+
+// Headless mode: runs the game logic without rendering or sleeping, driven by
+// an input log of "<tick> <key>" lines as written with --record, where tick
+// counts the ticks since the start and key is the key code returned by
+// readSenseHatJoystick()/readKeyboard(). Keys are handled exactly like the
+// main loop does, KEY_ENTER ends the run. Without one the run ends on the
+// last logged tick.
+typedef struct {
+  unsigned long tick;
+  int key;
+} inputEvent;
+
+inputEvent *loadInputLog(char const *path, size_t *count) {
+  FILE *log = fopen(path, "r");
+  if (!log) {
+    fprintf(stderr, "ERROR: could not open input log %s\n", path);
+    return NULL;
+  }
+  size_t capacity = 256;
+  inputEvent *events = malloc(capacity * sizeof(inputEvent));
+  *count = 0;
+  char line[64];
+  unsigned long lineNumber = 0;
+  while (events && fgets(line, sizeof(line), log)) {
+    lineNumber++;
+    inputEvent event;
+    char extra;
+    // a truncated log must not replay as a shorter game
+    if (sscanf(line, "%lu %d %c", &event.tick, &event.key, &extra) != 2) {
+      line[strcspn(line, "\n")] = '\0';
+      fprintf(stderr, "ERROR: malformed line %lu in %s: %s\n", lineNumber, path, line);
+      break;
+    }
+    // a tick plays at most one key, as in the main loop
+    if (*count && event.tick <= events[*count - 1].tick) {
+      fprintf(stderr, "ERROR: tick %lu in %s does not follow tick %lu\n", event.tick, path,
+              events[*count - 1].tick);
+      break;
+    }
+    if (*count == capacity) {
+      capacity *= 2;
+      inputEvent *grown = realloc(events, capacity * sizeof(inputEvent));
+      if (!grown) {
+        free(events);
+        events = NULL;
         break;
-      case 7:
-        fprintf(stdout, "| %17s\n", (game.state == GAMEOVER) ? "Game Over" : "");
+      }
+      events = grown;
+    }
+    events[(*count)++] = event;
+  }
+  if (!events)
+    fprintf(stderr, "ERROR: could not allocate input log %s\n", path);
+  bool const complete = events && feof(log) && !ferror(log);
+  fclose(log);
+  if (!complete) {
+    free(events);
+    return NULL;
+  }
+  return events;
+}
+
+// FNV-1a over the playfield and the game counters
+unsigned long gameChecksum(gameConfig *game) {
+  unsigned long hash = 14695981039346656037UL;
+  unsigned int const values[] = {game->tiles, game->rows, game->score, game->level, game->state};
+  for (unsigned int y = 0; y < game->grid.y; y++) {
+    for (unsigned int x = 0; x < game->grid.x; x++) {
+      coord const checkTile = {x, y};
+      hash = (hash ^ (unsigned short) (tileOccupied(game, checkTile) ? tileColor(game, checkTile) : 0)) * 1099511628211UL;
+    }
+  }
+  for (unsigned int i = 0; i < sizeof(values) / sizeof(values[0]); i++) {
+    hash = (hash ^ values[i]) * 1099511628211UL;
+  }
+  return hash;
+}
+
+// Same start state as main: empty playfield, game over
+void resetGame(gameConfig *game) {
+  game->tiles = 0;
+  game->rows = 0;
+  game->score = 0;
+  game->level = 0;
+  game->tick = 0;
+  resetPlayfield(game);
+  gameOver(game);
+}
+
+// returns the number of ticks played
+unsigned long replayInputLog(gameConfig *game, inputEvent const *events, size_t count) {
+  unsigned long tick = 0;
+  size_t next = 0;
+  resetGame(game);
+  while (next < count) {
+    int key = 0;
+    if (events[next].tick == tick) {
+      key = events[next++].key;
+    }
+    if (key == KEY_ENTER)
+      break;
+    sTetris(game, key);
+    game->tick = (game->tick + 1) % game->nextGameTick;
+    tick++;
+  }
+  return tick;
+}
+
+int runHeadless(gameConfig *game, char const *path, unsigned long repeat) {
+  size_t count;
+  inputEvent *events = loadInputLog(path, &count);
+  if (!events)
+    return 1;
+
+  struct timespec start, end;
+  unsigned long ticks = 0;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (unsigned long i = 0; i < repeat; i++) {
+    ticks = replayInputLog(game, events, count);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double const seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+  printf("Ticks:    %lu\n", ticks);
+  printf("Tiles:    %u\n", game->tiles);
+  printf("Rows:     %u\n", game->rows);
+  printf("Score:    %u\n", game->score);
+  printf("Level:    %u\n", game->level);
+  printf("State:    %s\n", (game->state == GAMEOVER) ? "Game Over" : "Active");
+  printf("Checksum: %016lx\n", gameChecksum(game));
+  if (repeat > 1) {
+    printf("Replays:  %lu in %.3f s, %.0f replays/s, %.0f ticks/s\n", repeat, seconds,
+           repeat / seconds, repeat * ticks / seconds);
+  }
+  free(events);
+  return 0;
+}
+
+
+// Self-play: plays many independent games on several threads, with a move
+// policy choosing the key of every tick, and reports the score and level
+// distributions. Every game gets its own gameConfig and is seeded from its
+// number, so the results do not depend on the number of threads.
+typedef int (*movePolicy)(gameConfig *game, unsigned int *seed);
+
+int randomPolicy(gameConfig *game, unsigned int *seed) {
+  (void) game;
+  static int const keys[] = {0, 0, 0, 0, 0, KEY_LEFT, KEY_RIGHT, KEY_DOWN};
+  return keys[rand_r(seed) % (sizeof(keys) / sizeof(keys[0]))];
+}
+
+// Moves the active tile to the column where it lands lowest, the leftmost one
+// on ties, and drops it there. One in GREEDY_EPSILON moves is random instead,
+// so games with different seeds differ.
+#define GREEDY_EPSILON 8
+
+int greedyPolicy(gameConfig *game, unsigned int *seed) {
+  if (!(game->state & ACTIVE))
+    return 0;
+  if (rand_r(seed) % GREEDY_EPSILON == 0)
+    return randomPolicy(game, seed);
+  coord const active = game->activeTile;
+  unsigned int bestX = active.x;
+  unsigned int bestY = 0;
+  for (unsigned int x = 0; x < game->grid.x; x++) {
+    coord landing = {x, active.y};
+    if (x != active.x && tileOccupied(game, landing))
+      continue;
+    while (landing.y < game->grid.y - 1) {
+      coord const below = {x, landing.y + 1};
+      if (tileOccupied(game, below))
         break;
-    default:
-        fprintf(stdout, "|\n");
+      landing = below;
+    }
+    if (landing.y > bestY) {
+      bestX = x;
+      bestY = landing.y;
     }
   }
-  for (unsigned int x = 0; x < game.grid.x + 2; x++) {
-    fprintf(stdout, "-");
+  // drop where we are if the way is blocked
+  if (bestX < active.x) {
+    coord const left = {active.x - 1, active.y};
+    if (!tileOccupied(game, left))
+      return KEY_LEFT;
+  } else if (bestX > active.x) {
+    coord const right = {active.x + 1, active.y};
+    if (!tileOccupied(game, right))
+      return KEY_RIGHT;
   }
-  fflush(stdout);
+  return KEY_DOWN;
 }
 
+struct {
+  char const *name;
+  movePolicy policy;
+} const policies[] = {
+  {"random", randomPolicy},
+  {"greedy", greedyPolicy},
+};
 
-inline unsigned long uSecFromTimespec(struct timespec const ts) {
-  return ((ts.tv_sec * 1000000) + (ts.tv_nsec / 1000));
+typedef struct {
+  unsigned int score;
+  unsigned int level;
+  unsigned int rows;
+  unsigned long ticks;
+  bool capped; // still running after maxTicks
+} gameResult;
+
+typedef struct {
+  movePolicy policy;
+  unsigned long games;
+  unsigned long maxTicks;
+  unsigned long rowsPerLevel;
+  unsigned int seed;
+  unsigned long nextGame; // taken atomically by the threads
+  gameResult *results;    // one per game
+} selfPlayRun;
+
+gameResult playGame(gameConfig *game, movePolicy policy, unsigned int seed, unsigned long maxTicks) {
+  gameResult result = {0};
+  resetGame(game);
+  // any key starts a new game
+  sTetris(game, KEY_UP);
+  game->tick = (game->tick + 1) % game->nextGameTick;
+  while (game->state != GAMEOVER && result.ticks < maxTicks) {
+    sTetris(game, policy(game, &seed));
+    game->tick = (game->tick + 1) % game->nextGameTick;
+    result.ticks++;
+  }
+  result.score = game->score;
+  result.level = game->level;
+  result.rows = game->rows;
+  result.capped = game->state != GAMEOVER;
+  return result;
+}
+
+void *selfPlayThread(void *arg) {
+  selfPlayRun *run = arg;
+  gameConfig instance = {
+    .grid = game.grid,
+    .uSecTickTime = game.uSecTickTime,
+    .rowsPerLevel = run->rowsPerLevel,
+    .initNextGameTick = game.initNextGameTick,
+  };
+  if (!allocatePlayfield(&instance))
+    return NULL;
+  while (true) {
+    unsigned long const i = __atomic_fetch_add(&run->nextGame, 1, __ATOMIC_RELAXED);
+    if (i >= run->games)
+      break;
+    run->results[i] = playGame(&instance, run->policy, run->seed + i, run->maxTicks);
+  }
+  freePlayfield(&instance);
+  return NULL;
+}
+
+int compareScores(void const *a, void const *b) {
+  unsigned int const x = ((gameResult const *) a)->score;
+  unsigned int const y = ((gameResult const *) b)->score;
+  return (x > y) - (x < y);
+}
+
+int runSelfPlay(selfPlayRun *run, unsigned int threads) {
+  run->results = calloc(run->games, sizeof(gameResult));
+  pthread_t *workers = malloc(threads * sizeof(pthread_t));
+  if (!run->results || !workers) {
+    fprintf(stderr, "ERROR: could not allocate self-play results\n");
+    return 1;
+  }
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (unsigned int i = 0; i < threads; i++) {
+    pthread_create(&workers[i], NULL, selfPlayThread, run);
+  }
+  for (unsigned int i = 0; i < threads; i++) {
+    pthread_join(workers[i], NULL);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double const seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+  unsigned long ticks = 0, rows = 0, score = 0, capped = 0;
+  unsigned int maxLevel = 0;
+  for (unsigned long i = 0; i < run->games; i++) {
+    ticks += run->results[i].ticks;
+    rows += run->results[i].rows;
+    score += run->results[i].score;
+    capped += run->results[i].capped;
+    if (run->results[i].level > maxLevel)
+      maxLevel = run->results[i].level;
+  }
+  unsigned long *levels = calloc(maxLevel + 1, sizeof(unsigned long));
+  for (unsigned long i = 0; i < run->games; i++) {
+    levels[run->results[i].level]++;
+  }
+  qsort(run->results, run->games, sizeof(gameResult), compareScores);
+
+  printf("Games:    %lu on %u threads in %.3f s, %.0f games/s, %.0f ticks/s\n", run->games, threads,
+         seconds, run->games / seconds, ticks / seconds);
+  if (capped)
+    printf("Capped:   %lu games still running after %lu ticks\n", capped, run->maxTicks);
+  printf("Rows:     %.2f per game\n", (double) rows / run->games);
+  printf("Score:    mean %.2f, min %u, p50 %u, p90 %u, p99 %u, max %u\n", (double) score / run->games,
+         run->results[0].score, run->results[run->games / 2].score,
+         run->results[run->games * 9 / 10].score, run->results[run->games * 99 / 100].score,
+         run->results[run->games - 1].score);
+  printf("Level     Games\n");
+  for (unsigned int level = 0; level <= maxLevel; level++) {
+    if (levels[level])
+      printf("%5u  %8lu\n", level, levels[level]);
+  }
+
+  free(levels);
+  free(workers);
+  free(run->results);
+  return 0;
+}
+
+
+// Event-driven main loop: tick n of the game is due at origin + n * uSecTickTime
+// on the monotonic clock. Instead of waking up on every tick, the loop sleeps in
+// epoll until a key arrives or the timerfd reports the next tick on which the
+// game has work to do (game->tick wrapping to zero). Ticks in between only
+// advance game->tick, so they are caught up in one go. The timer is set to an
+// absolute time, so processing time does not add drift, and it is disarmed
+// while the game is over.
+typedef struct {
+  struct timespec origin;
+  unsigned long ticks; // ticks [0, ticks) have been played
+} tickClock;
+
+unsigned long currentTick(tickClock const *clock, unsigned long uSecTickTime) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  unsigned long const uSec = (now.tv_sec - clock->origin.tv_sec) * 1000000UL +
+                             (now.tv_nsec - clock->origin.tv_nsec) / 1000;
+  return uSec / uSecTickTime;
+}
+
+// Plays the ticks up to (not including) target without a key press, returns
+// true if the playfield changed
+bool catchUpTicks(gameConfig *game, tickClock *clock, unsigned long target) {
+  bool playfieldChanged = false;
+  while (clock->ticks < target) {
+    if (game->tick == 0)
+      playfieldChanged |= sTetris(game, 0);
+    unsigned long skip = game->nextGameTick - game->tick;
+    if (skip > target - clock->ticks)
+      skip = target - clock->ticks;
+    game->tick = (game->tick + skip) % game->nextGameTick;
+    clock->ticks += skip;
+  }
+  return playfieldChanged;
+}
+
+// Plays the current tick with a key press
+bool playKey(gameConfig *game, tickClock *clock, int key) {
+  bool const playfieldChanged = sTetris(game, key);
+  game->tick = (game->tick + 1) % game->nextGameTick;
+  clock->ticks++;
+  return playfieldChanged;
+}
+
+void armTickTimer(int timerFd, gameConfig const *game, tickClock const *clock) {
+  struct itimerspec timer = {0};
+  if (game->state & ACTIVE) {
+    unsigned long const due = clock->ticks + (game->nextGameTick - game->tick) % game->nextGameTick;
+    unsigned long const uSec = due * game->uSecTickTime + clock->origin.tv_nsec / 1000;
+    timer.it_value.tv_sec = clock->origin.tv_sec + uSec / 1000000;
+    timer.it_value.tv_nsec = (uSec % 1000000) * 1000 + clock->origin.tv_nsec % 1000;
+  }
+  timerfd_settime(timerFd, TFD_TIMER_ABSTIME, &timer, NULL);
 }
 
 int main(int argc, char **argv) {
-  (void) argc;
-  (void) argv;
+  char const *headlessLog = NULL;
+  char const *recordLog = NULL;
+  char const *virtualHat = NULL;
+  unsigned long repeat = 1;
+  unsigned int threads = 1;
+  selfPlayRun selfPlay = {
+    .policy = randomPolicy,
+    .maxTicks = 100000,
+    .rowsPerLevel = game.rowsPerLevel,
+    .seed = 1,
+  };
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "--headless") && i + 1 < argc) {
+      headlessLog = argv[++i];
+    } else if (!strcmp(argv[i], "--virtual") && i + 1 < argc) {
+      virtualHat = argv[++i];
+    } else if (!strcmp(argv[i], "--record") && i + 1 < argc) {
+      recordLog = argv[++i];
+    } else if (!strcmp(argv[i], "--repeat") && i + 1 < argc) {
+      repeat = strtoul(argv[++i], NULL, 10);
+    } else if (!strcmp(argv[i], "--selfplay") && i + 1 < argc) {
+      selfPlay.games = strtoul(argv[++i], NULL, 10);
+    } else if (!strcmp(argv[i], "--threads") && i + 1 < argc) {
+      threads = strtoul(argv[++i], NULL, 10);
+    } else if (!strcmp(argv[i], "--policy") && i + 1 < argc) {
+      i++;
+      selfPlay.policy = NULL;
+      for (unsigned int p = 0; p < sizeof(policies) / sizeof(policies[0]); p++) {
+        if (!strcmp(argv[i], policies[p].name))
+          selfPlay.policy = policies[p].policy;
+      }
+      if (!selfPlay.policy) {
+        fprintf(stderr, "ERROR: unknown policy %s\n", argv[i]);
+        return 1;
+      }
+    } else if (!strcmp(argv[i], "--rows-per-level") && i + 1 < argc) {
+      selfPlay.rowsPerLevel = strtoul(argv[++i], NULL, 10);
+    } else if (!strcmp(argv[i], "--max-ticks") && i + 1 < argc) {
+      selfPlay.maxTicks = strtoul(argv[++i], NULL, 10);
+    } else if (!strcmp(argv[i], "--seed") && i + 1 < argc) {
+      selfPlay.seed = strtoul(argv[++i], NULL, 10);
+    } else {
+      fprintf(stderr, "Usage: %s [--virtual PREFIX] [--record input.log]\n"
+              "       %s --headless input.log [--repeat N]\n"
+              "       %s --selfplay N [--threads N] [--policy random|greedy] [--rows-per-level N]\n"
+              "                   [--max-ticks N] [--seed N]\n", argv[0], argv[0], argv[0]);
+      return 1;
+    }
+  }
+
+  if (selfPlay.games) {
+    if (!threads || !selfPlay.rowsPerLevel) {
+      fprintf(stderr, "ERROR: threads and rows per level must be at least 1\n");
+      return 1;
+    }
+    return runSelfPlay(&selfPlay, threads);
+  }
+
+  if (!allocatePlayfield(&game))
+    return 1;
+
+  if (headlessLog) {
+    if (!repeat) {
+      fprintf(stderr, "ERROR: repeat must be at least 1\n");
+      freePlayfield(&game);
+      return 1;
+    }
+    int const ret = runHeadless(&game, headlessLog, repeat);
+    freePlayfield(&game);
+    return ret;
+  }
+
+  FILE *record = NULL;
+  if (recordLog) {
+    record = fopen(recordLog, "w");
+    if (!record) {
+      fprintf(stderr, "ERROR: could not open %s for recording\n", recordLog);
+      return 1;
+    }
+  }
+
   // This sets the stdin in a special state where each
   // keyboard press is directly flushed to the stdin and additionally
   // not outputted to the stdout
@@ -499,60 +1156,105 @@ int main(int argc, char **argv) {
     ttystate.c_cc[VMIN] = 1;
     tcsetattr(STDIN_FILENO, TCSANOW, &ttystate);
   }
+  // epoll only sees what is still in the kernel, so stdio must not read ahead
+  setvbuf(stdin, NULL, _IONBF, 0);
 
 
-  // Allocate the playing field structure
-  game.rawPlayfield = (tile *) malloc(game.grid.x * game.grid.y * sizeof(tile));
-  game.playfield = (tile**) malloc(game.grid.y * sizeof(tile *));
-  if (!game.playfield || !game.rawPlayfield) {
-    fprintf(stderr, "ERROR: could not allocate playfield\n");
-    return 1;
-  }
-  for (unsigned int y = 0; y < game.grid.y; y++) {
-    game.playfield[y] = &(game.rawPlayfield[y * game.grid.x]);
-  }
-
   // Reset playfield to make it empty
-  resetPlayfield();
+  resetPlayfield(&game);
   // Start with gameOver
-  gameOver();
+  gameOver(&game);
 
-  if (!initializeSenseHat()) {
+  if (!initializeSenseHat(virtualHat)) {
     fprintf(stderr, "ERROR: could not initilize sense hat\n");
     return 1;
   };
+  if (!initializeRenderer(&game)) {
+    fprintf(stderr, "ERROR: could not allocate the renderer\n");
+    return 1;
+  }
+  // the prints above must not end up behind the first frame
+  fflush(stdout);
 
   // Clear console, render first time
-  fprintf(stdout, "\033[H\033[J");
-  renderConsole(true);
-  renderSenseHatMatrix(true);
-
-  while (true) {
-    struct timeval sTv, eTv;
-    gettimeofday(&sTv, NULL);
-
-    int key = readSenseHatJoystick();
-    if (!key)
-      key = readKeyboard();
-    if (key == KEY_ENTER)
-      break;
+  renderConsole(&game, true);
+  renderSenseHatMatrix(&game, true);
+
+  int const timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+  int const epollFd = epoll_create1(EPOLL_CLOEXEC);
+  int const inputFds[] = {hat.joystick_fd, STDIN_FILENO};
+  if (timerFd < 0 || epollFd < 0) {
+    fprintf(stderr, "ERROR: could not set up timer and epoll\n");
+    return 1;
+  }
+  for (unsigned int i = 0; i < sizeof(inputFds) / sizeof(inputFds[0]); i++) {
+    struct epoll_event event = {.events = EPOLLIN, .data.fd = inputFds[i]};
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, inputFds[i], &event);
+  }
+  {
+    struct epoll_event event = {.events = EPOLLIN, .data.fd = timerFd};
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, timerFd, &event);
+  }
 
-    bool playfieldChanged = sTetris(key);
-    renderConsole(playfieldChanged);
-    renderSenseHatMatrix(playfieldChanged);
+  tickClock clock = {0};
+  clock_gettime(CLOCK_MONOTONIC, &clock.origin);
+  bool running = true;
+  while (running) {
+    struct epoll_event events[4];
+    int const ready = epoll_wait(epollFd, events, sizeof(events) / sizeof(events[0]), -1);
+    bool playfieldChanged = false;
+
+    for (int i = 0; i < ready && running; i++) {
+      unsigned long const now = currentTick(&clock, game.uSecTickTime);
+      if (events[i].data.fd == timerFd) {
+        uint64_t expirations;
+        // ticks are counted on the clock, the read only clears the event
+        if (read(timerFd, &expirations, sizeof(expirations)) != sizeof(expirations))
+          continue;
+        playfieldChanged |= catchUpTicks(&game, &clock, now + 1);
+        continue;
+      }
 
-    // Wait for next tick
-    gettimeofday(&eTv, NULL);
-    unsigned long const uSecProcessTime = ((eTv.tv_sec * 1000000) + eTv.tv_usec) - ((sTv.tv_sec * 1000000 + sTv.tv_usec));
-    if (uSecProcessTime < game.uSecTickTime) {
-      usleep(game.uSecTickTime - uSecProcessTime);
+      // play every pending key, each in the tick it arrived in or the next
+      // free one if that tick already had a key
+      int key;
+      while (running && (key = events[i].data.fd == hat.joystick_fd ? readSenseHatJoystick() : readKeyboard())) {
+        if (events[i].data.fd != hat.joystick_fd)
+          clock_gettime(CLOCK_MONOTONIC, &hat.keyTime);
+        playfieldChanged |= catchUpTicks(&game, &clock, now);
+        if (record)
+          fprintf(record, "%lu %d\n", clock.ticks, key);
+        if (key == KEY_ENTER) {
+          running = false;
+          break;
+        }
+        if (playKey(&game, &clock, key)) {
+          playfieldChanged = true;
+          latencyInput(&hat.latency, hat.keyTime);
+        }
+      }
+      // a closed stdin stays readable, so stop watching it once it is drained
+      if (events[i].data.fd == STDIN_FILENO &&
+          (feof(stdin) || ferror(stdin) || (events[i].events & (EPOLLHUP | EPOLLERR))))
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, STDIN_FILENO, NULL);
     }
-    game.tick = (game.tick + 1) % game.nextGameTick;
+
+    renderConsole(&game, playfieldChanged);
+    renderSenseHatMatrix(&game, playfieldChanged);
+    armTickTimer(timerFd, &game, &clock);
   }
 
+  close(epollFd);
+  close(timerFd);
+
+  if (record)
+    fclose(record);
+  // below the playfield
+  printf("\n");
+  printLatency(stdout, &hat.latency);
   freeSenseHat();
-  free(game.playfield);
-  free(game.rawPlayfield);
+  freeRenderer();
+  freePlayfield(&game);
 
   return 0;
 }